@@ -0,0 +1,614 @@
+// Runs the bitmap renderer for a fixed number of frames under each
+// combination of the given settings and reports frame timing percentiles.
+//
+//   ./benchmark --mode=headless,windowed,encoded,gl,vulkan --sizes=512x512,2048x2048
+//       --patterns=none,square,scattered,full --present-modes=fifo,mailbox
+//       --pacing=throughput,low_latency --record-threads=1,2,4,8
+//       --draws=1,256 --layers=1,256 --memory=direct,staging --frames=1000 --warmup=30
+//       --format=json --output=results.json
+//
+// The gl and vulkan modes draw the same patterns through BitmapPresenter
+// instead, in a window, comparing the two backends on this machine. They
+// only report frame_ms and draw_ms, and ignore the present mode, pacing,
+// record threads, draws and layers.
+//
+// The encoded mode runs headless, but draws the patterns into a bitmap of its
+// own and hands the renderer each frame encoded with a FrameEncoder, which it
+// decodes on the GPU. upload_mb is then the encoded size, and encode_ms the
+// time taken to encode. It always draws one layer.
+//
+// Present modes and pacing only apply to windowed runs. A present mode the
+// surface doesn't support falls back to FIFO with a warning. Output is CSV
+// with one row per configuration and metric, or a JSON array with one object
+// per configuration. Record threads and draws set the RecordingOptions, and
+// record_ms shows how recording the draws scales with threads. Layers
+// composites that many bitmaps of the given size in a grid, each drawing the
+// pattern. Memory picks the MemoryPath. Direct is always staged with more
+// than one layer, and falls back to staging with a warning where the device
+// doesn't support it.
+//
+//   ./benchmark --mode=kernels --target=1920x1440 --frames=200
+//
+// checks every pixel kernel implementation the CPU supports against the scalar
+// one, failing if any differ, and then times each kernel over a target sized
+// span of pixels.
+#include "bitmap_presenters.h"
+#include "bitmap_renderer.h"
+#include "frame_codec.h"
+#include "pixel_kernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct Size {
+  uint32_t width;
+  uint32_t height;
+};
+
+struct BenchmarkConfig {
+  // headless, windowed, encoded, or a presenter backend.
+  std::string mode;
+  Size bitmap_size;
+  std::string pattern;
+  std::string present_mode;
+  std::string pacing;
+  uint32_t record_threads;
+  uint32_t draw_count;
+  uint32_t layer_count;
+  std::string memory;
+};
+
+struct Percentiles {
+  double mean;
+  double p50;
+  double p95;
+  double p99;
+  double max;
+};
+
+const std::map<std::string, VkPresentModeKHR> kPresentModes = {
+  {"fifo", VK_PRESENT_MODE_FIFO_KHR},
+  {"fifo_relaxed", VK_PRESENT_MODE_FIFO_RELAXED_KHR},
+  {"mailbox", VK_PRESENT_MODE_MAILBOX_KHR},
+  {"immediate", VK_PRESENT_MODE_IMMEDIATE_KHR},
+};
+
+const std::map<std::string, FramePacing> kPacings = {
+  {"throughput", FramePacing::kThroughput},
+  {"low_latency", FramePacing::kLowLatency},
+};
+
+const std::map<std::string, MemoryPath> kMemoryPaths = {
+  {"direct", MemoryPath::kDirect},
+  {"staging", MemoryPath::kStaging},
+};
+
+const std::vector<std::string> kPatterns = {"none", "square", "scattered", "full"};
+
+std::vector<std::string> Split(const std::string& list, char separator) {
+  std::vector<std::string> items;
+  std::stringstream stream(list);
+  std::string item;
+  while (std::getline(stream, item, separator)) {
+    if (!item.empty()) items.push_back(item);
+  }
+  return items;
+}
+
+Size ParseSize(const std::string& size) {
+  auto parts = Split(size, 'x');
+  if (parts.size() != 2) {
+    std::cerr << "Bad size " << size << ", expected WIDTHxHEIGHT" << std::endl;
+    exit(1);
+  }
+  return {(uint32_t)std::stoul(parts[0]), (uint32_t)std::stoul(parts[1])};
+}
+
+// Nearest rank percentiles.
+Percentiles ComputePercentiles(std::vector<double> values) {
+  if (values.empty()) return {0, 0, 0, 0, 0};
+  std::sort(values.begin(), values.end());
+  auto rank = [&](double p) {
+    size_t rank = (size_t)std::ceil(p * values.size());
+    return values[std::max(rank, (size_t)1) - 1];
+  };
+  double sum = 0;
+  for (double value : values) sum += value;
+  return {sum / values.size(), rank(0.50), rank(0.95), rank(0.99), values.back()};
+}
+
+// Draws one frame of a dirty region pattern into every layer and marks what
+// it touched:
+//   none: nothing changes after the first frame.
+//   square: a 64x64 square bounces around, like the demo.
+//   scattered: 16 random 16x16 rects change every frame.
+//   full: the whole bitmap changes every frame.
+class PatternDrawer {
+  using MarkDirtyFunction = std::function<void(uint32_t layer, const DirtyRect& rect)>;
+  MarkDirtyFunction mark_dirty;
+  size_t layer_size;
+  std::string pattern;
+  uint32_t layer_count;
+  uint32_t frame = 0;
+  DirtyRect square = {0, 0, 64, 64};
+  int32_t dx = 5, dy = 3;
+  std::mt19937 random;
+
+  void Fill(uint8_t* bitmap, uint32_t width, uint32_t layer, DirtyRect rect, uint8_t value) {
+    bitmap += layer * layer_size;
+    for (uint32_t y = rect.y; y < rect.Bottom(); ++y) {
+      memset(bitmap + ((size_t)y * width + rect.x) * 4, value, rect.width * 4);
+    }
+    mark_dirty(layer, rect);
+  }
+
+public:
+  PatternDrawer(const MarkDirtyFunction& mark_dirty, size_t layer_size, const std::string& pattern, uint32_t layer_count)
+      : mark_dirty(mark_dirty), layer_size(layer_size), pattern(pattern), layer_count(layer_count), random(1) {}
+
+  void operator()(uint8_t* bitmap, uint32_t width, uint32_t height) {
+    uint8_t value = frame++ * 7;
+    DirtyRect old_square = square;
+    if (pattern == "square" && frame > 1) {
+      if ((int32_t)square.x + dx < 0 || (int32_t)square.Right() + dx > (int32_t)width) dx = -dx;
+      if ((int32_t)square.y + dy < 0 || (int32_t)square.Bottom() + dy > (int32_t)height) dy = -dy;
+      square.x += dx;
+      square.y += dy;
+    }
+    for (uint32_t layer = 0; layer < layer_count; ++layer) {
+      if (frame == 1 || pattern == "full") {
+        Fill(bitmap, width, layer, {0, 0, width, height}, value);
+      } else if (pattern == "square") {
+        Fill(bitmap, width, layer, old_square, 0);
+        Fill(bitmap, width, layer, square, 255);
+      } else if (pattern == "scattered") {
+        for (int i = 0; i < 16; ++i) {
+          uint32_t x = random() % std::max(width - 16, 1u);
+          uint32_t y = random() % std::max(height - 16, 1u);
+          Fill(bitmap, width, layer, {x, y, std::min(16u, width), std::min(16u, height)}, value);
+        }
+      }
+    }
+  }
+};
+
+std::map<std::string, Percentiles> RunBenchmark(const BenchmarkConfig& config, const Size& target_size, uint32_t frames, uint32_t warmup) {
+  BitmapRenderer renderer(config.bitmap_size.width, config.bitmap_size.height, config.layer_count);
+  auto mark_dirty = [&](uint32_t layer, const DirtyRect& rect) {
+    renderer.MarkLayerDirty(layer, rect.x, rect.y, rect.width, rect.height);
+  };
+  PatternDrawer draw(mark_dirty, renderer.LayerSize(), config.pattern, config.layer_count);
+  RecordingOptions recording_options;
+  recording_options.threads = config.record_threads;
+  recording_options.draw_count = config.draw_count;
+  renderer.SetRecordingOptions(recording_options);
+  if (config.memory != "none") {
+    renderer.SetMemoryPath(kMemoryPaths.at(config.memory));
+  }
+
+  std::map<std::string, std::vector<double>> samples;
+  renderer.SetFrameStatsFunction([&](const FrameStats& stats) {
+    if (stats.frame < warmup) return;
+    samples["frame_ms"].push_back(stats.frame_ms);
+    samples["cpu_ms"].push_back(stats.cpu_ms);
+    samples["draw_ms"].push_back(stats.draw_ms);
+    samples["upload_ms"].push_back(stats.upload_ms);
+    samples["record_ms"].push_back(stats.record_ms);
+    samples["upload_mb"].push_back(stats.upload_bytes / (1024.0 * 1024.0));
+    samples["fence_wait_ms"].push_back(stats.fence_wait_ms);
+    samples["acquire_ms"].push_back(stats.acquire_ms);
+    samples["present_ms"].push_back(stats.present_ms);
+  });
+  renderer.SetGpuTimingsFunction([&](const GpuTimings& timings) {
+    if (timings.frame < warmup) return;
+    if (timings.upload_ms >= 0) samples["gpu_upload_ms"].push_back(timings.upload_ms);
+    if (timings.draw_ms >= 0) samples["gpu_draw_ms"].push_back(timings.draw_ms);
+  });
+
+  if (config.mode == "headless") {
+    HeadlessOptions options;
+    options.width = target_size.width;
+    options.height = target_size.height;
+    options.frame_count = warmup + frames;
+    renderer.RunHeadless(options, std::ref(draw));
+  } else if (config.mode == "encoded") {
+    std::vector<uint8_t> bitmap(renderer.LayerSize());
+    DirtyRegion dirty(config.bitmap_size.width, config.bitmap_size.height);
+    PatternDrawer draw_bitmap([&](uint32_t, const DirtyRect& rect) { dirty.Add(rect); }, 0, config.pattern, 1);
+    FrameEncoder encoder(config.bitmap_size.width, config.bitmap_size.height);
+    EncodedFrame encoded;
+    uint32_t frame = 0;
+    renderer.SetEncodedInput(true);
+
+    HeadlessOptions options;
+    options.width = target_size.width;
+    options.height = target_size.height;
+    options.frame_count = warmup + frames;
+    renderer.RunHeadless(options, [&](uint8_t*, uint32_t width, uint32_t height) {
+      dirty.Clear();
+      draw_bitmap(bitmap.data(), width, height);
+      Clock::time_point encode_start = Clock::now();
+      encoder.Encode(bitmap.data(), dirty, &encoded);
+      if (frame++ >= warmup) samples["encode_ms"].push_back(MillisecondsSince(encode_start));
+      renderer.UploadEncodedFrame(encoded);
+    });
+  } else {
+    WindowOptions options;
+    options.width = target_size.width;
+    options.height = target_size.height;
+    options.frame_count = warmup + frames;
+    options.present_modes = {kPresentModes.at(config.present_mode)};
+    options.pacing = kPacings.at(config.pacing);
+    renderer.Run(options, std::ref(draw));
+    if (renderer.PresentMode() != options.present_modes[0]) {
+      std::cerr << "Present mode " << config.present_mode << " isn't supported, used fifo" << std::endl;
+    }
+  }
+
+  if (config.memory == "direct" && config.layer_count == 1 && !renderer.DirectTextures()) {
+    std::cerr << "Direct textures aren't supported, used staging" << std::endl;
+  }
+
+  std::map<std::string, Percentiles> results;
+  for (const auto& metric : samples) {
+    results[metric.first] = ComputePercentiles(metric.second);
+  }
+  return results;
+}
+
+// Times whole frames, from acquiring the bitmap to presenting it, through a
+// presenter backend.
+std::map<std::string, Percentiles> RunPresenterBenchmark(const BenchmarkConfig& config, const Size& target_size, uint32_t frames, uint32_t warmup) {
+  auto presenter = CreateBitmapPresenter(config.mode == "gl" ? PresenterBackend::kGl : PresenterBackend::kVulkan);
+  presenter->Create(target_size.width, target_size.height, config.bitmap_size.width, config.bitmap_size.height);
+  auto mark_dirty = [&](uint32_t layer, const DirtyRect& rect) {
+    presenter->MarkDirty(rect.x, rect.y, rect.width, rect.height);
+  };
+  PatternDrawer draw(mark_dirty, 0, config.pattern, 1);
+
+  std::map<std::string, std::vector<double>> samples;
+  for (uint32_t frame = 0; frame < warmup + frames && presenter->ProcessEvents(); ++frame) {
+    Clock::time_point frame_start = Clock::now();
+    uint8_t* bitmap = presenter->AcquireBitmap();
+    Clock::time_point draw_start = Clock::now();
+    draw(bitmap, config.bitmap_size.width, config.bitmap_size.height);
+    double draw_ms = MillisecondsSince(draw_start);
+    presenter->Present();
+    if (frame < warmup) continue;
+    samples["frame_ms"].push_back(MillisecondsSince(frame_start));
+    samples["draw_ms"].push_back(draw_ms);
+  }
+
+  std::map<std::string, Percentiles> results;
+  for (const auto& metric : samples) {
+    results[metric.first] = ComputePercentiles(metric.second);
+  }
+  return results;
+}
+
+void WriteCsvHeader(std::ostream& out) {
+  out << "mode,bitmap_width,bitmap_height,pattern,present_mode,pacing,record_threads,draws,layers,memory,frames,metric,mean,p50,p95,p99,max\n";
+}
+
+void WriteCsv(std::ostream& out, const BenchmarkConfig& config, uint32_t frames, const std::map<std::string, Percentiles>& results) {
+  for (const auto& metric : results) {
+    const Percentiles& p = metric.second;
+    out << config.mode << ","
+        << config.bitmap_size.width << "," << config.bitmap_size.height << ","
+        << config.pattern << "," << config.present_mode << "," << config.pacing << ","
+        << config.record_threads << "," << config.draw_count << "," << config.layer_count << "," << config.memory << "," << frames << ","
+        << metric.first << "," << p.mean << "," << p.p50 << "," << p.p95 << "," << p.p99 << "," << p.max << "\n";
+  }
+}
+
+void WriteJson(std::ostream& out, const BenchmarkConfig& config, uint32_t frames, const std::map<std::string, Percentiles>& results) {
+  out << "  {\"mode\": \"" << config.mode << "\""
+      << ", \"bitmap_width\": " << config.bitmap_size.width
+      << ", \"bitmap_height\": " << config.bitmap_size.height
+      << ", \"pattern\": \"" << config.pattern << "\""
+      << ", \"present_mode\": \"" << config.present_mode << "\""
+      << ", \"pacing\": \"" << config.pacing << "\""
+      << ", \"record_threads\": " << config.record_threads
+      << ", \"draws\": " << config.draw_count
+      << ", \"layers\": " << config.layer_count
+      << ", \"memory\": \"" << config.memory << "\""
+      << ", \"frames\": " << frames
+      << ", \"metrics\": {";
+  bool first = true;
+  for (const auto& metric : results) {
+    const Percentiles& p = metric.second;
+    out << (first ? "" : ", ") << "\"" << metric.first << "\": {"
+        << "\"mean\": " << p.mean << ", \"p50\": " << p.p50 << ", \"p95\": " << p.p95
+        << ", \"p99\": " << p.p99 << ", \"max\": " << p.max << "}";
+    first = false;
+  }
+  out << "}}";
+}
+
+// Random pixels, with a good share of fully transparent and fully opaque
+// ones since the kernels special case those.
+std::vector<Pixel> RandomPixels(size_t count, std::mt19937& random) {
+  std::vector<Pixel> pixels(count);
+  for (auto& pixel : pixels) {
+    pixel = random();
+    switch (random() % 4) {
+      case 0: pixel &= 0x00ffffff; break;
+      case 1: pixel |= 0xff000000; break;
+    }
+  }
+  return pixels;
+}
+
+// Compares every kernel against the scalar version over all span lengths up
+// to a few vectors, starting at every alignment. Returns false on a mismatch.
+bool CheckPixelKernels(const PixelKernels& kernels) {
+  const PixelKernels& scalar = kScalarPixelKernels;
+  std::mt19937 random(1);
+  bool passed = true;
+  auto check = [&](const char* kernel, const std::vector<Pixel>& expected, const std::vector<Pixel>& actual, size_t length) {
+    if (expected != actual) {
+      std::cerr << kernels.name << " " << kernel << " differs from scalar for " << length << " pixels" << std::endl;
+      passed = false;
+    }
+  };
+
+  for (int round = 0; round < 16; ++round) {
+    for (size_t offset = 0; offset < 8; ++offset) {
+      for (size_t length = 0; length <= 67; ++length) {
+        std::vector<Pixel> dst = RandomPixels(offset + length, random);
+        std::vector<Pixel> src = RandomPixels(offset + length, random);
+        Pixel color = RandomPixels(1, random)[0];
+        std::vector<Pixel> expected, actual;
+
+        expected = actual = dst;
+        scalar.fill(expected.data() + offset, length, color);
+        kernels.fill(actual.data() + offset, length, color);
+        check("fill", expected, actual, length);
+
+        expected = actual = dst;
+        scalar.blend(expected.data() + offset, src.data() + offset, length);
+        kernels.blend(actual.data() + offset, src.data() + offset, length);
+        check("blend", expected, actual, length);
+
+        expected = actual = dst;
+        scalar.blend_color(expected.data() + offset, length, color);
+        kernels.blend_color(actual.data() + offset, length, color);
+        check("blend_color", expected, actual, length);
+
+        // The conversions are checked in place.
+        expected = actual = src;
+        scalar.premultiply(expected.data() + offset, expected.data() + offset, length);
+        kernels.premultiply(actual.data() + offset, actual.data() + offset, length);
+        check("premultiply", expected, actual, length);
+
+        expected = actual = src;
+        scalar.unpremultiply(expected.data() + offset, expected.data() + offset, length);
+        kernels.unpremultiply(actual.data() + offset, actual.data() + offset, length);
+        check("unpremultiply", expected, actual, length);
+
+        expected = actual = src;
+        scalar.swap_red_blue(expected.data() + offset, expected.data() + offset, length);
+        kernels.swap_red_blue(actual.data() + offset, actual.data() + offset, length);
+        check("swap_red_blue", expected, actual, length);
+      }
+    }
+  }
+
+  // Every value of every channel and alpha, once through each conversion.
+  std::vector<Pixel> all(1 << 16);
+  for (uint32_t i = 0; i < all.size(); ++i) {
+    uint32_t value = i & 0xff, alpha = i >> 8;
+    all[i] = Rgba(value, 255 - value, value / 2, alpha);
+  }
+  std::vector<Pixel> expected(all.size()), actual(all.size());
+  scalar.premultiply(expected.data(), all.data(), all.size());
+  kernels.premultiply(actual.data(), all.data(), all.size());
+  check("premultiply", expected, actual, all.size());
+  scalar.unpremultiply(expected.data(), all.data(), all.size());
+  kernels.unpremultiply(actual.data(), all.data(), all.size());
+  check("unpremultiply", expected, actual, all.size());
+  return passed;
+}
+
+// Times each kernel over the given number of pixels. Reports milliseconds
+// per call and the throughput in megapixels per second, in the same CSV and
+// JSON layouts as the renderer benchmarks but with their own columns.
+void BenchmarkPixelKernels(std::ostream& out, bool json, size_t pixel_count, uint32_t iterations) {
+  std::mt19937 random(1);
+  std::vector<Pixel> src = RandomPixels(pixel_count, random);
+  std::vector<Pixel> dst = RandomPixels(pixel_count, random);
+  Pixel color = Rgba(200, 100, 50, 128);
+
+  bool first_json_object = true;
+  if (json) {
+    out << "[\n";
+  } else {
+    out << "implementation,kernel,pixels,iterations,metric,mean,p50,p95,p99,max\n";
+  }
+  for (const PixelKernels* kernels : SupportedPixelKernels()) {
+    std::vector<std::pair<std::string, std::function<void()>>> benchmarks = {
+      {"fill", [&] { kernels->fill(dst.data(), pixel_count, color); }},
+      {"blend", [&] { kernels->blend(dst.data(), src.data(), pixel_count); }},
+      {"blend_color", [&] { kernels->blend_color(dst.data(), pixel_count, color); }},
+      {"premultiply", [&] { kernels->premultiply(dst.data(), src.data(), pixel_count); }},
+      {"unpremultiply", [&] { kernels->unpremultiply(dst.data(), src.data(), pixel_count); }},
+      {"swap_red_blue", [&] { kernels->swap_red_blue(dst.data(), src.data(), pixel_count); }},
+    };
+    for (const auto& benchmark : benchmarks) {
+      std::map<std::string, std::vector<double>> samples;
+      benchmark.second();
+      for (uint32_t i = 0; i < iterations; ++i) {
+        Clock::time_point start = Clock::now();
+        benchmark.second();
+        double ms = MillisecondsSince(start);
+        samples["ms"].push_back(ms);
+        samples["mpixels_per_s"].push_back(pixel_count / (ms * 1000.0));
+      }
+
+      if (json) {
+        out << (first_json_object ? "" : ",\n")
+            << "  {\"mode\": \"kernels\", \"implementation\": \"" << kernels->name << "\""
+            << ", \"kernel\": \"" << benchmark.first << "\""
+            << ", \"pixels\": " << pixel_count << ", \"iterations\": " << iterations
+            << ", \"metrics\": {";
+        first_json_object = false;
+      }
+      bool first_metric = true;
+      for (const auto& metric : samples) {
+        Percentiles p = ComputePercentiles(metric.second);
+        if (json) {
+          out << (first_metric ? "" : ", ") << "\"" << metric.first << "\": {"
+              << "\"mean\": " << p.mean << ", \"p50\": " << p.p50 << ", \"p95\": " << p.p95
+              << ", \"p99\": " << p.p99 << ", \"max\": " << p.max << "}";
+        } else {
+          out << kernels->name << "," << benchmark.first << "," << pixel_count << "," << iterations << ","
+              << metric.first << "," << p.mean << "," << p.p50 << "," << p.p95 << "," << p.p99 << "," << p.max << "\n";
+        }
+        first_metric = false;
+      }
+      if (json) {
+        out << "}}";
+      }
+      out.flush();
+    }
+  }
+  if (json) {
+    out << "\n]\n";
+  }
+}
+
+int main(int argc, char** argv) {
+  std::map<std::string, std::string> flags = {
+    {"mode", "headless"},
+    {"sizes", "512x512"},
+    {"patterns", "square"},
+    {"present-modes", "fifo"},
+    {"pacing", "throughput"},
+    {"record-threads", "1"},
+    {"draws", "1"},
+    {"layers", "1"},
+    {"memory", "direct"},
+    {"target", "1920x1440"},
+    {"frames", "1000"},
+    {"warmup", "30"},
+    {"format", "csv"},
+    {"output", ""},
+  };
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    size_t equals = arg.find('=');
+    if (arg.compare(0, 2, "--") != 0 || equals == std::string::npos ||
+        !flags.count(arg.substr(2, equals - 2))) {
+      std::cerr << "Unknown argument " << arg << std::endl;
+      return 1;
+    }
+    flags[arg.substr(2, equals - 2)] = arg.substr(equals + 1);
+  }
+
+  uint32_t frames = std::stoul(flags["frames"]);
+  uint32_t warmup = std::stoul(flags["warmup"]);
+  Size target_size = ParseSize(flags["target"]);
+  bool json = flags["format"] == "json";
+
+  std::ofstream file;
+  if (!flags["output"].empty()) {
+    file.open(flags["output"]);
+  }
+  std::ostream& out = flags["output"].empty() ? std::cout : file;
+
+  if (flags["mode"] == "kernels") {
+    for (const PixelKernels* kernels : SupportedPixelKernels()) {
+      if (!CheckPixelKernels(*kernels)) return 1;
+    }
+    BenchmarkPixelKernels(out, json, (size_t)target_size.width * target_size.height, frames);
+    return 0;
+  }
+
+  std::vector<BenchmarkConfig> configs;
+  for (const auto& mode : Split(flags["mode"], ',')) {
+    PresenterBackend backend;
+    bool presenter = mode != "auto" && ParsePresenterBackend(mode, &backend);
+    if (mode != "headless" && mode != "windowed" && mode != "encoded" && !presenter) {
+      std::cerr << "Unknown mode " << mode << std::endl;
+      return 1;
+    }
+    bool headless = mode == "headless" || mode == "encoded";
+    // Headless runs never present, so they only run once, and presenters
+    // don't take any of the renderer's options.
+    bool fixed = headless || presenter;
+    auto present_modes = fixed ? std::vector<std::string>{"none"} : Split(flags["present-modes"], ',');
+    auto pacings = fixed ? std::vector<std::string>{"none"} : Split(flags["pacing"], ',');
+    auto record_thread_counts = presenter ? std::vector<std::string>{"1"} : Split(flags["record-threads"], ',');
+    auto draw_counts = presenter ? std::vector<std::string>{"1"} : Split(flags["draws"], ',');
+    auto layer_counts = presenter || mode == "encoded" ? std::vector<std::string>{"1"} : Split(flags["layers"], ',');
+    // Encoded input always has a staging buffer of its own.
+    bool own_memory = presenter || mode == "encoded";
+    auto memory_paths = own_memory ? std::vector<std::string>{"none"} : Split(flags["memory"], ',');
+    for (const auto& memory : memory_paths) {
+      if (!own_memory && !kMemoryPaths.count(memory)) {
+        std::cerr << "Unknown memory path " << memory << std::endl;
+        return 1;
+      }
+    }
+    for (const auto& size : Split(flags["sizes"], ',')) {
+      for (const auto& pattern : Split(flags["patterns"], ',')) {
+        if (std::find(kPatterns.begin(), kPatterns.end(), pattern) == kPatterns.end()) {
+          std::cerr << "Unknown pattern " << pattern << std::endl;
+          return 1;
+        }
+        for (const auto& present_mode : present_modes) {
+          if (!fixed && !kPresentModes.count(present_mode)) {
+            std::cerr << "Unknown present mode " << present_mode << std::endl;
+            return 1;
+          }
+          for (const auto& pacing : pacings) {
+            if (!fixed && !kPacings.count(pacing)) {
+              std::cerr << "Unknown pacing " << pacing << std::endl;
+              return 1;
+            }
+            for (const auto& record_threads : record_thread_counts) {
+              for (const auto& draws : draw_counts) {
+                for (const auto& layers : layer_counts) {
+                  for (const auto& memory : memory_paths) {
+                    configs.push_back({mode, ParseSize(size), pattern, present_mode, pacing,
+                                       (uint32_t)std::stoul(record_threads), (uint32_t)std::stoul(draws),
+                                       (uint32_t)std::stoul(layers), memory});
+                  }
+                }
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+
+  if (json) {
+    out << "[\n";
+  } else {
+    WriteCsvHeader(out);
+  }
+  for (size_t i = 0; i < configs.size(); ++i) {
+    bool presenter = configs[i].mode != "headless" && configs[i].mode != "windowed" && configs[i].mode != "encoded";
+    auto results = presenter ? RunPresenterBenchmark(configs[i], target_size, frames, warmup)
+                             : RunBenchmark(configs[i], target_size, frames, warmup);
+    if (json) {
+      WriteJson(out, configs[i], frames, results);
+      out << (i + 1 < configs.size() ? ",\n" : "\n");
+    } else {
+      WriteCsv(out, configs[i], frames, results);
+    }
+    out.flush();
+  }
+  if (json) {
+    out << "]\n";
+  }
+}
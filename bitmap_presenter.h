@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+
+#include <SDL2/SDL.h>
+
+// Shows an RGBA bitmap in a window, whatever the graphics API underneath.
+// The caller runs the frame loop:
+//
+//   presenter->Create(1920, 1440, 512, 512);
+//   while (presenter->ProcessEvents()) {
+//     uint8_t* bitmap = presenter->AcquireBitmap();
+//     ... draw into bitmap ...
+//     presenter->MarkDirty(x, y, width, height);
+//     presenter->Present();
+//   }
+//
+// Each backend uploads the dirty parts of the bitmap in whatever way is
+// fastest for it.
+class BitmapPresenter {
+public:
+  virtual ~BitmapPresenter() {}
+
+  // For logs and benchmark output.
+  virtual const char* Name() const = 0;
+
+  // Opens a window_width x window_height window showing a bitmap_width x
+  // bitmap_height bitmap, scaled to fill it.
+  virtual void Create(uint32_t window_width, uint32_t window_height, uint32_t bitmap_width, uint32_t bitmap_height) = 0;
+
+  // Returns the bitmap to draw the next frame into, with rows bitmap_width
+  // pixels apart. It holds the previous frame, and is only valid until
+  // Present.
+  virtual uint8_t* AcquireBitmap() = 0;
+
+  // Marks part of the acquired bitmap as changed. Only marked parts are
+  // guaranteed to be shown.
+  virtual void MarkDirty(uint32_t x, uint32_t y, uint32_t width, uint32_t height) = 0;
+
+  // Shows the acquired bitmap.
+  virtual void Present() = 0;
+
+  // Changes the bitmap's size between frames. Its contents are lost, so the
+  // next frame has to draw and mark all of it.
+  virtual void Resize(uint32_t bitmap_width, uint32_t bitmap_height) = 0;
+
+  // Handles the window's events. Returns false once it's been closed.
+  virtual bool ProcessEvents() {
+    SDL_Event event;
+    bool open = true;
+    while (SDL_PollEvent(&event)) {
+      if (event.type == SDL_QUIT) {
+        open = false;
+      }
+    }
+    return open;
+  }
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "bitmap_presenter.h"
+#include "gl_bitmap_presenter.h"
+#include "vulkan_bitmap_presenter.h"
+
+#include <memory>
+#include <string>
+
+enum class PresenterBackend {
+  // Vulkan when there's a device for it, since its uploads don't go through
+  // the driver's copies, and GL otherwise.
+  kAuto,
+  kVulkan,
+  kGl,
+};
+
+// Parses "auto", "vulkan" or "gl". Returns false for anything else.
+bool ParsePresenterBackend(const std::string& name, PresenterBackend* backend) {
+  if (name == "auto") {
+    *backend = PresenterBackend::kAuto;
+  } else if (name == "vulkan") {
+    *backend = PresenterBackend::kVulkan;
+  } else if (name == "gl") {
+    *backend = PresenterBackend::kGl;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Whether there's a Vulkan driver with at least one device.
+bool VulkanAvailable() {
+  vkh::InstanceCreateInfo instance_info;
+  VkInstance instance;
+  if (vkCreateInstance(&instance_info, nullptr, &instance) != VK_SUCCESS) {
+    return false;
+  }
+  uint32_t device_count = 0;
+  vkEnumeratePhysicalDevices(instance, &device_count, nullptr);
+  vkDestroyInstance(instance, nullptr);
+  return device_count > 0;
+}
+
+std::unique_ptr<BitmapPresenter> CreateBitmapPresenter(PresenterBackend backend) {
+  if (backend == PresenterBackend::kAuto) {
+    backend = VulkanAvailable() ? PresenterBackend::kVulkan : PresenterBackend::kGl;
+  }
+  if (backend == PresenterBackend::kVulkan) {
+    return std::unique_ptr<BitmapPresenter>(new VulkanBitmapPresenter());
+  }
+  return std::unique_ptr<BitmapPresenter>(new GlBitmapPresenter());
+}
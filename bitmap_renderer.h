@@ -0,0 +1,2454 @@
+#pragma once
+
+#include "vulkan_util.h"
+#include "dirty_region.h"
+#include "frame_codec.h"
+#include "thread_pool.h"
+#include "shaders/decode.comp.spv.h"
+#include "shaders/quad.vert.spv.h"
+#include "shaders/quad.frag.spv.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_vulkan.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define MAX_IN_FLIGHT_FRAMES 2
+uint32_t current_frame = 0;
+
+const uint32_t kDefaultWidth = 1920;
+const uint32_t kDefaultHeight = 1440;
+
+const uint32_t kDefaultBitmapWidth = 512;
+const uint32_t kDefaultBitmapHeight = 512;
+
+// Fills in the RGBA bitmap that will be shown on the next frame. The bitmap
+// starts out holding the previous frame, and only the parts marked with
+// BitmapRenderer::MarkDirty are uploaded. A renderer with several layers
+// hands over all of them, each width x height and LayerSize() bytes after the
+// one before.
+using DrawBitmapFunction = std::function<void(uint8_t* bitmap, uint32_t width, uint32_t height)>;
+
+// Receives each frame of a headless run as tightly packed RGBA rows. The
+// pixels are only valid for the duration of the call.
+using ReadbackFunction = std::function<void(const uint8_t* pixels, uint32_t width, uint32_t height)>;
+
+// Present modes in order of preference. The first one the surface supports
+// is used, and FIFO, which every surface supports, is the last resort.
+using PresentModePolicy = std::vector<VkPresentModeKHR>;
+
+const PresentModePolicy kVsyncPresentModes = {VK_PRESENT_MODE_FIFO_KHR};
+// Never blocks on the display, preferring not to tear.
+const PresentModePolicy kLowLatencyPresentModes = {
+    VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_IMMEDIATE_KHR, VK_PRESENT_MODE_FIFO_RELAXED_KHR};
+
+enum class FramePacing {
+  // Lets up to MAX_IN_FLIGHT_FRAMES frames queue up on the GPU.
+  kThroughput,
+  // Waits for the previous frame to finish on the GPU before drawing the next
+  // one, so the bitmap is drawn as late as possible and shown with at most
+  // one frame of GPU work in between. The wait gives up at the frame deadline
+  // so a slow GPU frame can't stall the CPU indefinitely.
+  kLowLatency,
+};
+
+enum class ViewFilter {
+  kNearest,
+  // Nearest, with the zoom rounded so every bitmap pixel covers the same whole
+  // number of target pixels, and the bitmap aligned to the pixel grid.
+  kIntegerNearest,
+  kLinear,
+};
+
+// Pans and zooms the layers on the GPU, so moving the view never redraws or
+// uploads the bitmap. The point center_x, center_y, in target coordinates
+// from (0, 0) at the top left to (1, 1) at the bottom right, is shown in the
+// middle of the target, magnified by zoom.
+struct ViewTransform {
+  float center_x = 0.5f;
+  float center_y = 0.5f;
+  float zoom = 1;
+  ViewFilter filter = ViewFilter::kNearest;
+};
+
+// Windowed runs go until the window is closed unless they're given a frame
+// count.
+struct WindowOptions {
+  uint32_t width = kDefaultWidth;
+  uint32_t height = kDefaultHeight;
+  uint32_t frame_count = 0;
+  PresentModePolicy present_modes = kVsyncPresentModes;
+  FramePacing pacing = FramePacing::kThroughput;
+  double frame_deadline_ms = 1000.0 / 60;
+};
+
+struct HeadlessOptions {
+  uint32_t width = kDefaultWidth;
+  uint32_t height = kDefaultHeight;
+  uint32_t frame_count = 1;
+  // Optional. Reading frames back adds a copy per frame.
+  ReadbackFunction readback;
+};
+
+enum class ExternalMemoryType {
+  // Shared memory like a memfd, which we map and import as host memory with
+  // VK_EXT_external_memory_host.
+  kHostMemory,
+  // Exported by Vulkan on the same driver and device, with
+  // VK_KHR_external_memory_fd.
+  kOpaqueFd,
+  // From a decoder, camera or another GPU API, with
+  // VK_EXT_external_memory_dma_buf.
+  kDmaBuf,
+};
+
+// Memory another process draws frames into. It's imported as the staging
+// buffer, so frames are copied straight from it into the textures with no
+// memcpy into a staging ring on our side.
+//
+// It holds slot_count bitmaps, each BitmapSize() bytes and laid out like the
+// bitmap handed to a DrawBitmapFunction, slot_stride apart. The producer
+// writes whole frames into free slots and the renderer is told which slot to
+// show with ShowExternalSlot.
+struct ExternalBitmapOptions {
+  ExternalMemoryType type = ExternalMemoryType::kHostMemory;
+  // Duplicated on every import, so the caller keeps theirs.
+  int fd = -1;
+  uint32_t slot_count = 1;
+  // Defaults to BitmapSize(). Must be a multiple of 4.
+  VkDeviceSize slot_stride = 0;
+  // Of the memory behind fd, which exported allocations must be imported
+  // with. Defaults to just enough for the slots, rounded up to a multiple of
+  // vkh::ImportedHostPointerAlignment() for host memory, which the fd has to
+  // be big enough to back.
+  VkDeviceSize size = 0;
+  // Called once no frame uses a slot that's been replaced by another, after
+  // which the producer can write it again.
+  std::function<void(uint32_t slot)> released;
+};
+
+// How each frame's draws are recorded. The layers are drawn as draw_count
+// horizontal bands, each a scissored, instanced draw of its own. With more than one
+// thread, the bands are split into a chunk per thread, and each chunk is
+// recorded into a secondary command buffer in parallel.
+struct RecordingOptions {
+  uint32_t threads = 1;
+  uint32_t draw_count = 1;
+};
+
+// How the bitmap gets from the CPU to the textures the GPU samples.
+enum class MemoryPath {
+  // Straight into mapped linear textures, when the device can map device
+  // local memory and the bitmap has a single layer, and staged otherwise.
+  kDirect,
+  // Always through the staging ring and a copy, even where direct would work,
+  // so the upload path can be tested and compared on any device.
+  kStaging,
+};
+
+// Where one frame's time went, in milliseconds, as seen from the CPU.
+struct FrameStats {
+  // Counts up from 0 in each run.
+  uint64_t frame;
+  // The whole frame, waits included.
+  double frame_ms;
+  // The frame minus the fence, acquire and present waits.
+  double cpu_ms;
+  // Waiting for the GPU to finish the last frame that used this frame's slot.
+  double fence_wait_ms;
+  double acquire_ms;
+  double present_ms;
+  // In the DrawBitmapFunction.
+  double draw_ms;
+  // Carrying the staging slice forward, and recording the upload or writing
+  // the direct texture.
+  double upload_ms;
+  uint64_t upload_bytes;
+  // Recording the draws.
+  double record_ms;
+};
+
+using FrameStatsFunction = std::function<void(const FrameStats&)>;
+
+// GPU time spent on a frame, measured with timestamp queries. Reported once
+// the frame's fence has signaled, which is a frame or two after it was drawn.
+struct GpuTimings {
+  uint64_t frame;
+  // Negative when the frame had no GPU upload or its queue can't write
+  // timestamps.
+  double upload_ms;
+  double draw_ms;
+};
+
+using GpuTimingsFunction = std::function<void(const GpuTimings&)>;
+
+using Clock = std::chrono::steady_clock;
+
+double MillisecondsSince(Clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// Host visible memory that the CPU reads from as well as writes, which is
+// much faster when it's cached.
+const vkh::MemoryPolicy kHostReadMemory = {
+    {VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, VK_MEMORY_PROPERTY_HOST_CACHED_BIT}};
+
+VkResult DefaultDeviceExtensionProperties(VkPhysicalDevice physical_device, uint32_t* pPropertyCount, VkExtensionProperties* pProperties) {
+  return vkEnumerateDeviceExtensionProperties(physical_device, NULL, pPropertyCount, pProperties);
+}
+
+template<class InputIt, class C, class UnaryPredicate>
+InputIt c_find_if(const C& container, const UnaryPredicate& p) {
+  return find_if(container.begin(), container.end(), p);
+}
+
+bool DeviceSupportsExtensions(VkPhysicalDevice physical_device, const std::vector<const char*>& necessary_extensions) {
+  auto supported_extensions = GetProps(physical_device, &DefaultDeviceExtensionProperties);
+
+  std::set<std::string> required_extensions(necessary_extensions.begin(), necessary_extensions.end());
+  for(const auto& extension : supported_extensions) {
+    required_extensions.erase(extension.extensionName);
+  }
+  return required_extensions.empty();
+}
+
+bool InstanceSupportsLayer(const char* layer_name) {
+  uint32_t layer_count = 0;
+  vkEnumerateInstanceLayerProperties(&layer_count, nullptr);
+  std::vector<VkLayerProperties> layers(layer_count);
+  vkEnumerateInstanceLayerProperties(&layer_count, layers.data());
+
+  for(const auto& layer : layers) {
+    if (strcmp(layer.layerName, layer_name) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool DeviceSupportsSwapchain(VkPhysicalDevice physical_device, VkSurfaceKHR surface) {
+  auto capabilities = vkh::GetPhysicalDeviceSurfaceCapabilitiesKHR(physical_device, surface);
+  auto surface_formats = GetProps(physical_device, surface, &vkGetPhysicalDeviceSurfaceFormatsKHR);
+  auto present_modes = GetProps(physical_device, surface, &vkGetPhysicalDeviceSurfacePresentModesKHR);
+  return !surface_formats.empty() && !present_modes.empty();
+}
+
+VkSurfaceFormatKHR ChooseSwapchainSurfaceFormat(VkPhysicalDevice physical_device, VkSurfaceKHR surface) {
+  auto surface_formats = GetProps(physical_device, surface, &vkGetPhysicalDeviceSurfaceFormatsKHR);
+  auto preferred_format = VK_FORMAT_B8G8R8A8_UNORM;
+  auto preferred_space = VK_COLOR_SPACE_SRGB_NONLINEAR_KHR;
+
+  // The swapchain can use any format.
+  if(surface_formats.size() == 1 && surface_formats[0].format == VK_FORMAT_UNDEFINED) {
+    return {preferred_format, preferred_space};
+  }
+
+  for(const auto& format : surface_formats) {
+    if(format.format == preferred_format && format.colorSpace == preferred_space) {
+      return format;
+    }
+  }
+
+  return surface_formats[0];
+}
+
+VkPresentModeKHR ChooseSwapchainPresentMode(VkPhysicalDevice physical_device, VkSurfaceKHR surface, const PresentModePolicy& policy) {
+  auto present_modes = GetProps(physical_device, surface, &vkGetPhysicalDeviceSurfacePresentModesKHR);
+  for (VkPresentModeKHR mode : policy) {
+    if (std::find(present_modes.begin(), present_modes.end(), mode) != present_modes.end()) {
+      return mode;
+    }
+  }
+  return VK_PRESENT_MODE_FIFO_KHR;
+}
+
+VkExtent2D ChooseSwapchainExtent(VkPhysicalDevice physical_device, VkSurfaceKHR surface, SDL_Window* window) {
+  auto capabilities = vkh::GetPhysicalDeviceSurfaceCapabilitiesKHR(physical_device, surface);
+
+  if (capabilities.currentExtent.width != std::numeric_limits<uint32_t>::max()) {
+    return capabilities.currentExtent;
+  } else {
+    int32_t width, height;
+    SDL_GetWindowSize(window, &width, &height);
+    return {(uint32_t)width, (uint32_t)height};
+  }
+}
+
+// Returns -1 if no queue family has support.
+int32_t GetQueueFamily(VkPhysicalDevice physical_device, VkQueueFlags flags) {
+  auto family_properties = GetProps(physical_device, &vkGetPhysicalDeviceQueueFamilyProperties);
+
+  for(int32_t i = 0; i < family_properties.size(); ++i) {
+    if((family_properties[i].queueFlags & flags) == flags) {
+      return i;
+    }
+  }
+
+  // No queue family supports these flags
+  return -1;
+}
+
+// Like GetQueueFamily, but skips families that also support graphics or
+// compute. Returns -1 if there's no such family.
+int32_t GetDedicatedQueueFamily(VkPhysicalDevice physical_device, VkQueueFlags flags) {
+  auto family_properties = GetProps(physical_device, &vkGetPhysicalDeviceQueueFamilyProperties);
+  const VkQueueFlags kGeneralFlags = VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT;
+
+  for(int32_t i = 0; i < family_properties.size(); ++i) {
+    if((family_properties[i].queueFlags & flags) == flags &&
+       !(family_properties[i].queueFlags & kGeneralFlags)) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+
+// Asserts that the chosen physical device has support for the given surface.
+// Without a surface, any device that can do graphics will do.
+VkPhysicalDevice ChoosePhysicalDevice(VkInstance instance, VkSurfaceKHR surface, const std::vector<const char*>& necessary_extensions) {
+  auto physical_devices = GetProps(instance, &vkEnumeratePhysicalDevices);
+
+  VkPhysicalDevice chosen_device = nullptr;
+  for (uint32_t i = 0; i < physical_devices.size(); ++i) {
+    VkPhysicalDevice device = physical_devices[i];
+    VkPhysicalDeviceProperties properties = vkh::GetPhysicalDeviceProperties(device);
+
+    bool supports_surface = surface == VK_NULL_HANDLE ||
+        (GetQueueFamilySupportingSurface(device, surface) != -1 && DeviceSupportsSwapchain(device, surface));
+    if (supports_surface &&
+        GetQueueFamily(device, VK_QUEUE_GRAPHICS_BIT) != -1 &&
+        DeviceSupportsExtensions(device, necessary_extensions)) {
+      chosen_device = device;
+      if (properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU) {
+        return device;
+      }
+    }
+  }
+
+  assert(chosen_device != nullptr);
+  return chosen_device;
+}
+
+
+class BitmapRenderer {
+  uint32_t bitmap_width;
+  uint32_t bitmap_height;
+  const uint32_t layer_count;
+
+  VkPhysicalDevice physical_device;
+  VkDevice device;
+  std::vector<VkFramebuffer> framebuffers;
+  // For one off setup work.
+  VkCommandPool command_pool;
+  // Each in-flight frame records its commands from scratch into a command
+  // buffer from its own pool, which is reset once the frame's fence signals.
+  std::vector<VkCommandPool> frame_command_pools;
+  std::vector<VkCommandBuffer> frame_command_buffers;
+
+  // With parallel recording, each frame also has a pool and secondary
+  // command buffer per chunk, indexed by [frame][chunk]. Only the thread
+  // recording a chunk touches its pool.
+  RecordingOptions recording_options;
+  std::unique_ptr<ThreadPool> recording_pool;
+  std::vector<std::vector<VkCommandPool>> secondary_command_pools;
+  std::vector<std::vector<VkCommandBuffer>> secondary_command_buffers;
+  VkPipeline graphics_pipeline;
+  VkPipelineLayout pipeline_layout;
+  VkRenderPass render_pass;
+  VkSwapchainKHR swapchain;
+
+  VkShaderModule vertex_module;
+  VkShaderModule fragment_module;
+
+  // The staging buffer is a ring with one bitmap sized slice per in-flight
+  // frame. Each slice is only written once that frame's fence has signaled.
+  VkBuffer staging_buffer;
+  vkh::Allocation staging_memory;
+  uint8_t* staging_data;
+
+  // With external memory, the staging buffer is the imported memory instead,
+  // and each frame uploads from the slot it showed, indexed by frame, or -1
+  // once the frame has finished. Host memory stays mapped at external_mapping.
+  bool external_bitmap;
+  ExternalBitmapOptions external_options;
+  uint32_t external_slot;
+  std::vector<int64_t> frame_external_slots;
+  VkDeviceMemory external_memory;
+  void* external_mapping;
+  size_t external_mapping_size;
+
+  // With encoded input, each staging slice holds an EncodedFrame's tile table
+  // and runs as they are, and a compute shader decodes them into the frame's
+  // texture on the graphics queue. Tiles are XORed onto the previous frame's
+  // texture, which is always current, and the tiles that only changed on
+  // other in-flight frames are added to the table without runs, which copies
+  // them. The textures start out cleared to zero, like the encoder.
+  bool encoded_input;
+  VkShaderModule decode_module;
+  VkDescriptorSetLayout decode_set_layout;
+  VkDescriptorPool decode_pool;
+  std::vector<VkDescriptorSet> decode_sets;
+  VkPipelineLayout decode_pipeline_layout;
+  VkPipeline decode_pipeline;
+  // Indexed by frame.
+  std::vector<uint32_t> encoded_tile_counts;
+  std::vector<size_t> encoded_sizes;
+  // Which tiles are in the current frame's table, indexed by tile.
+  std::vector<bool> tiles_listed;
+
+  // In the layout of decode.comp's push constants.
+  struct DecodePushConstants {
+    uint32_t width;
+    uint32_t height;
+    uint32_t tile_count;
+    uint32_t words_offset;
+  };
+
+  // What changed in each layer on the last frame written to each slice,
+  // indexed by [frame][layer].
+  std::vector<std::vector<DirtyRegion>> dirty_regions;
+
+  // One per visible layer, in the layout of quad.vert's storage buffer.
+  struct LayerInstance {
+    float x, y, width, height;
+    uint32_t layer;
+    uint32_t padding[3];
+  };
+
+  // Where each layer is drawn, indexed by layer. Hidden layers have no size.
+  std::vector<LayerInstance> layer_placements;
+
+  // In the layout of the quad shaders' push constants.
+  struct ViewPushConstants {
+    float scale[2];
+    float offset[2];
+    uint32_t nearest;
+  };
+  ViewTransform view_transform;
+
+  // Every layer is drawn by one instanced draw that reads the visible layers'
+  // placements out of the frame's instance buffer. The buffers are host
+  // visible and rewritten once the frame's fence has signaled.
+  std::vector<VkBuffer> instance_buffers;
+  std::vector<vkh::Allocation> instance_memories;
+  std::vector<LayerInstance*> instance_data;
+  std::vector<uint32_t> instance_counts;
+
+  // Each in-flight frame also gets its own texture, a 2D array with an image
+  // per layer, so uploading the next frame never has to wait for the previous
+  // frame to finish drawing.
+  std::vector<VkImage> texture_images;
+  std::vector<vkh::Allocation> texture_memories;
+  std::vector<VkImageView> texture_views;
+  std::vector<VkDescriptorSet> descriptor_sets;
+  std::vector<bool> textures_initialized;
+  VkSampler texture_sampler;
+
+  VkDescriptorSetLayout descriptor_set_layout;
+  VkDescriptorPool descriptor_pool;
+
+  // When the device can map device local memory (resizable BAR, integrated
+  // GPUs), the textures are linear images that the CPU writes directly, so
+  // there's no staging ring and nothing to upload. The bitmap is drawn into
+  // host_bitmap, which is always current, and each frame streams its upload
+  // region from there into its mapped texture. Devices needn't support linear
+  // images with more than one layer, so this is only done for a single layer.
+  MemoryPath memory_path;
+  bool direct_textures;
+  std::vector<uint8_t> host_bitmap;
+  std::vector<uint8_t*> texture_data;
+  VkDeviceSize texture_row_pitch;
+
+  // When the transfer queue is in the graphics family, uploads are recorded
+  // into the frame's command buffer ahead of the draw. Otherwise they're
+  // recorded into a per-frame transfer command buffer, submitted to the
+  // transfer queue and hand the texture over with upload_finished and
+  // texture_released semaphores.
+  VkQueue transfer_queue;
+  int32_t transfer_queue_family;
+  std::vector<VkCommandPool> transfer_command_pools;
+  std::vector<VkCommandBuffer> upload_command_buffers;
+  std::vector<VkSemaphore> upload_finished_semaphores;
+  std::vector<VkSemaphore> texture_released_semaphores;
+
+  // What the render pass draws into: the swapchain's images, or in a headless
+  // run, offscreen images.
+  std::vector<VkImageView> target_image_views;
+  VkFormat target_format;
+  VkImageLayout target_final_layout;
+  VkExtent2D target_extent;
+
+  // The objects a swapchain recreation replaces. Frames submitted before the
+  // recreation may still be using them, so they're kept until all of those
+  // frames have finished, which is at the latest when every in-flight frame's
+  // fence has been waited on once more.
+  struct RetiredTargets {
+    uint64_t frame_number;
+    VkSwapchainKHR swapchain;
+    std::vector<VkImageView> image_views;
+    std::vector<VkFramebuffer> framebuffers;
+  };
+  std::vector<RetiredTargets> retired_targets;
+
+  // Headless runs have no window, surface or swapchain. They draw into an
+  // offscreen image per in-flight frame, and when there's a readback
+  // function, copy each frame into a host visible buffer that's handed to it
+  // once the frame's fence signals.
+  bool headless;
+  std::vector<VkImage> offscreen_images;
+  std::vector<vkh::Allocation> offscreen_memories;
+  ReadbackFunction readback;
+  std::vector<VkBuffer> readback_buffers;
+  std::vector<vkh::Allocation> readback_memories;
+  std::vector<bool> readback_pending;
+
+  VkInstance instance;
+  VkDebugReportCallbackEXT debug_callback;
+  VkSurfaceKHR surface;
+
+  VkQueue graphics_queue;
+  VkQueue present_queue;
+
+  int32_t graphics_queue_family;
+  int32_t present_queue_family;
+
+  std::vector<VkSemaphore> image_available_semaphores;
+  std::vector<VkSemaphore> render_finished_semaphores;
+  std::vector<VkFence> in_flight_fences;
+
+  SDL_Window* window;
+  PresentModePolicy present_mode_policy;
+  VkPresentModeKHR present_mode;
+  FramePacing frame_pacing;
+  uint64_t frame_deadline_ns;
+
+  FrameStatsFunction frame_stats_function;
+  uint64_t frame_number;
+
+  // The frame between BeginFrame and EndFrame.
+  FrameStats frame_stats;
+  Clock::time_point frame_start;
+  Clock::time_point draw_start;
+  std::vector<DirtyRegion> frame_upload_regions;
+
+  // Empty when the pipeline cache isn't kept between runs.
+  std::string pipeline_cache_path;
+
+  // Timestamp queries are only written when there's a GpuTimingsFunction and
+  // the graphics queue supports them. Each frame has its own pool with a
+  // begin and end query for its upload and for its draw.
+  enum TimestampQuery { kUploadBegin, kUploadEnd, kDrawBegin, kDrawEnd, kTimestampQueryCount };
+  GpuTimingsFunction gpu_timings_function;
+  std::vector<VkQueryPool> timestamp_pools;
+  uint64_t graphics_timestamp_mask;
+  // Zero when uploads go to a transfer queue without timestamps.
+  uint64_t upload_timestamp_mask;
+  double timestamp_period_ns;
+  std::vector<uint64_t> timed_frames;
+  std::vector<bool> uploads_timed;
+  std::vector<bool> timings_pending;
+
+  void DestroyTargets(const std::vector<VkImageView>& image_views, const std::vector<VkFramebuffer>& target_framebuffers) {
+    for (size_t i = 0; i < target_framebuffers.size(); i++) {
+        vkDestroyFramebuffer(device, target_framebuffers[i], nullptr);
+    }
+    for (size_t i = 0; i < image_views.size(); i++) {
+        vkDestroyImageView(device, image_views[i], nullptr);
+    }
+  }
+
+  // The targets must not be in use.
+  void DestroyRenderTargets() {
+    DestroyTargets(target_image_views, framebuffers);
+    framebuffers.clear();
+    target_image_views.clear();
+  }
+
+  // Destroys retired targets once the frames that could use them are done, or
+  // all of them when the device is idle.
+  void DestroyRetiredTargets(bool device_idle) {
+    for (size_t i = 0; i < retired_targets.size();) {
+      const RetiredTargets& retired = retired_targets[i];
+      if (!device_idle && frame_number < retired.frame_number + MAX_IN_FLIGHT_FRAMES) {
+        ++i;
+        continue;
+      }
+      DestroyTargets(retired.image_views, retired.framebuffers);
+      vkDestroySwapchainKHR(device, retired.swapchain, nullptr);
+      retired_targets.erase(retired_targets.begin() + i);
+    }
+  }
+
+  // Called with the device idle.
+  void DestroySwapchain() {
+    DestroyRetiredTargets(true);
+    DestroyRenderTargets();
+    DestroyPipeline();
+    vkDestroySwapchainKHR(device, swapchain, nullptr);
+    swapchain = VK_NULL_HANDLE;
+  }
+
+  // Only the extent dependent objects are rebuilt. The pipeline draws with a
+  // dynamic viewport, so it and the render pass are kept unless the surface
+  // format changed. The old swapchain is handed to the new one, so frames
+  // already queued on it still get presented, and it's retired along with its
+  // views and framebuffers instead of waiting for the queue to drain.
+  void RecreateSwapchain() {
+    auto swapchain_capabilities = vkh::GetPhysicalDeviceSurfaceCapabilitiesKHR(physical_device, surface);
+    uint32_t image_count = swapchain_capabilities.minImageCount + 1;
+    if (swapchain_capabilities.minImageCount == swapchain_capabilities.maxImageCount) {
+      image_count = swapchain_capabilities.maxImageCount;
+    }
+
+    auto surface_format = ChooseSwapchainSurfaceFormat(physical_device, surface);
+    present_mode = ChooseSwapchainPresentMode(physical_device, surface, present_mode_policy);
+    target_extent = ChooseSwapchainExtent(physical_device, surface, window);
+
+    // We'd expect to possibly change imageUsage, maybe queue families?
+    vkh::SwapchainCreateInfoKHR F(swapchain_info,
+        surface = surface,
+        minImageCount = image_count,
+        imageFormat = surface_format.format,
+        imageColorSpace = surface_format.colorSpace,
+        imageExtent = target_extent,
+        imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+        presentMode = present_mode,
+        oldSwapchain = swapchain
+    );
+
+    int32_t swapchain_families[] = {graphics_queue_family, present_queue_family};
+
+    if (graphics_queue_family != present_queue_family) {
+        swapchain_info.imageSharingMode = VK_SHARING_MODE_CONCURRENT;
+        swapchain_info.queueFamilyIndexCount = 2;
+        swapchain_info.pQueueFamilyIndices = (uint32_t*)swapchain_families;
+    } else {
+        swapchain_info.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    }
+
+    VkSwapchainKHR new_swapchain = vkh::CreateSwapchainKHR(swapchain_info);
+    if (swapchain != VK_NULL_HANDLE) {
+      retired_targets.push_back({frame_number, swapchain, target_image_views, framebuffers});
+      target_image_views.clear();
+      framebuffers.clear();
+    }
+    swapchain = new_swapchain;
+
+    // Format changes are rare enough that we just wait for the pipeline to be
+    // free.
+    if (render_pass != VK_NULL_HANDLE && surface_format.format != target_format) {
+      vkDeviceWaitIdle(device);
+      DestroyPipeline();
+    }
+    target_format = surface_format.format;
+    target_final_layout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    if (render_pass == VK_NULL_HANDLE) {
+      CreatePipeline();
+    }
+    auto swapchain_images = GetProps(device, swapchain, &vkGetSwapchainImagesKHR);
+    for(const auto image : swapchain_images) {
+      vkh::ImageViewCreateInfo F(image_view_info,
+          image = image,
+          format = target_format
+      );
+
+      target_image_views.push_back(vkh::CreateImageView(image_view_info));
+    }
+
+    CreateRenderTargets();
+  }
+
+  // Offscreen images are RGBA like the bitmap, so read back frames are laid
+  // out the same way.
+  void CreateOffscreenTargets(uint32_t width, uint32_t height) {
+    target_format = VK_FORMAT_R8G8B8A8_UNORM;
+    target_final_layout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    target_extent = {width, height};
+
+    for (uint32_t i=0; i<MAX_IN_FLIGHT_FRAMES; ++i) {
+      vkh::Allocation offscreen_memory;
+      VkImage offscreen_image = vkh::CreateImage(width, height, target_format, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &offscreen_memory);
+      vkh::ImageViewCreateInfo F(image_view_info,
+          image = offscreen_image,
+          format = target_format
+      );
+      target_image_views.push_back(vkh::CreateImageView(image_view_info));
+      offscreen_images.push_back(offscreen_image);
+      offscreen_memories.push_back(offscreen_memory);
+
+      if (readback) {
+        vkh::Allocation readback_memory;
+        readback_buffers.push_back(vkh::CreateBuffer(width * height * 4, VK_BUFFER_USAGE_TRANSFER_DST_BIT, kHostReadMemory, &readback_memory));
+        readback_memories.push_back(readback_memory);
+      }
+    }
+    readback_pending.assign(MAX_IN_FLIGHT_FRAMES, false);
+  }
+
+  // Called after DestroyRenderTargets, which destroys the views.
+  void DestroyOffscreenTargets() {
+    for (uint32_t i=0; i<offscreen_images.size(); ++i) {
+      vkDestroyImage(device, offscreen_images[i], nullptr);
+      vkh::FreeMemory(offscreen_memories[i]);
+    }
+    for (uint32_t i=0; i<readback_buffers.size(); ++i) {
+      vkDestroyBuffer(device, readback_buffers[i], nullptr);
+      vkh::FreeMemory(readback_memories[i]);
+    }
+    offscreen_images.clear();
+    offscreen_memories.clear();
+    readback_buffers.clear();
+    readback_memories.clear();
+  }
+
+  // Hands a finished frame to the readback function. The frame's fence must
+  // have signaled.
+  void DeliverReadback(uint32_t frame) {
+    if (!readback_pending[frame]) return;
+    readback_pending[frame] = false;
+    readback(static_cast<const uint8_t*>(vkh::MapMemory(readback_memories[frame])), target_extent.width, target_extent.height);
+  }
+
+  static uint64_t TimestampMask(uint32_t valid_bits) {
+    return valid_bits >= 64 ? ~0ull : (1ull << valid_bits) - 1;
+  }
+
+  void CreateTimestampPools() {
+    if (!gpu_timings_function) return;
+    auto family_properties = GetProps(physical_device, &vkGetPhysicalDeviceQueueFamilyProperties);
+    graphics_timestamp_mask = TimestampMask(family_properties[graphics_queue_family].timestampValidBits);
+    if (family_properties[graphics_queue_family].timestampValidBits == 0) return;
+    upload_timestamp_mask = graphics_timestamp_mask;
+    if (SeparateTransferQueue()) {
+      uint32_t valid_bits = family_properties[transfer_queue_family].timestampValidBits;
+      upload_timestamp_mask = valid_bits ? TimestampMask(valid_bits) : 0;
+    }
+    timestamp_period_ns = vkh::GetPhysicalDeviceCache().properties.limits.timestampPeriod;
+
+    vkh::QueryPoolCreateInfo F(query_pool_info,
+        queryType = VK_QUERY_TYPE_TIMESTAMP,
+        queryCount = kTimestampQueryCount
+    );
+    for (uint32_t i=0; i<MAX_IN_FLIGHT_FRAMES; ++i) {
+      timestamp_pools.push_back(vkh::CreateQueryPool(query_pool_info));
+    }
+    timed_frames.assign(MAX_IN_FLIGHT_FRAMES, 0);
+    uploads_timed.assign(MAX_IN_FLIGHT_FRAMES, false);
+    timings_pending.assign(MAX_IN_FLIGHT_FRAMES, false);
+  }
+
+  void DestroyTimestampPools() {
+    for (VkQueryPool pool : timestamp_pools) {
+      vkDestroyQueryPool(device, pool, nullptr);
+    }
+    timestamp_pools.clear();
+  }
+
+  // Returns a negative time if the queries aren't available.
+  double TimestampMilliseconds(VkQueryPool pool, uint32_t begin_query, uint64_t mask) {
+    uint64_t timestamps[2];
+    if (vkGetQueryPoolResults(device, pool, begin_query, 2, sizeof(timestamps), timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) != VK_SUCCESS) {
+      return -1;
+    }
+    return ((timestamps[1] - timestamps[0]) & mask) * timestamp_period_ns / 1e6;
+  }
+
+  // Reads a frame's timestamps back. The frame's fence must have signaled,
+  // which also covers uploads on the transfer queue since the draw waits on
+  // them, so this never stalls.
+  void ReportGpuTimings(uint32_t frame) {
+    if (!timings_pending[frame]) return;
+    timings_pending[frame] = false;
+
+    GpuTimings timings = {timed_frames[frame], -1, -1};
+    if (uploads_timed[frame]) {
+      timings.upload_ms = TimestampMilliseconds(timestamp_pools[frame], kUploadBegin, upload_timestamp_mask);
+    }
+    timings.draw_ms = TimestampMilliseconds(timestamp_pools[frame], kDrawBegin, graphics_timestamp_mask);
+    gpu_timings_function(timings);
+  }
+
+  // A slot is free again once it's no longer shown and the last frame that
+  // uploaded from it has finished.
+  void ReleaseExternalSlot(uint32_t frame) {
+    int64_t slot = frame_external_slots[frame];
+    frame_external_slots[frame] = -1;
+    if (slot == -1 || slot == external_slot || !external_options.released) return;
+    for (int64_t other_slot : frame_external_slots) {
+      if (other_slot == slot) return;
+    }
+    external_options.released(slot);
+  }
+
+  // Hands over everything that was waiting on a frame's fence.
+  void CollectFinishedFrame(uint32_t frame) {
+    if (readback) {
+      DeliverReadback(frame);
+    }
+    if (!timestamp_pools.empty()) {
+      ReportGpuTimings(frame);
+    }
+    if (external_bitmap) {
+      ReleaseExternalSlot(frame);
+    }
+  }
+
+  // Called once the device is idle at the end of a run. Oldest first.
+  void CollectFinishedFrames() {
+    for (uint32_t i = 1; i <= MAX_IN_FLIGHT_FRAMES; ++i) {
+      CollectFinishedFrame((current_frame + i) % MAX_IN_FLIGHT_FRAMES);
+    }
+  }
+
+  // Copies a finished offscreen frame into its readback buffer, in the
+  // render pass's final layout.
+  void RecordReadback(VkCommandBuffer command_buffer, uint32_t target) {
+    vkh::BufferImageCopy copy_region(target_extent);
+    vkCmdCopyImageToBuffer(command_buffer, offscreen_images[target], target_final_layout, readback_buffers[target], 1, &copy_region);
+
+    vkh::MemoryBarrier F(host_barrier,
+        srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        dstAccessMask = VK_ACCESS_HOST_READ_BIT
+    );
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+        0, 1, &host_barrier, 0, nullptr, 0, nullptr);
+  }
+
+  // Creates the render pass and pipeline for the current target format and
+  // final layout. These are the same for windowed and headless runs, and
+  // don't depend on the target extent.
+  void CreatePipeline() {
+
+    vkh::PipelineShaderStageCreateInfo F(vertex_stage_info,
+       stage = VK_SHADER_STAGE_VERTEX_BIT,
+       module = vertex_module
+    );
+    vkh::PipelineShaderStageCreateInfo F(fragment_stage_info,
+       stage = VK_SHADER_STAGE_FRAGMENT_BIT,
+       module = fragment_module
+    );
+    std::vector<VkPipelineShaderStageCreateInfo> pipeline_stages {vertex_stage_info, fragment_stage_info};
+    const VkVertexInputBindingDescription kVertexBindingDescription{0, sizeof(float)*3};
+    const VkVertexInputAttributeDescription kVertexAttributeDescription{0, 0, VK_FORMAT_R32G32B32_SFLOAT, 0};
+    /*
+    vkh::VertexInputState F(vertex_input_state,
+       vertexBindingDescriptionCount = 1,
+       pVertexBindingDescriptions = &kVertexBindingDescription,
+       vertexAttributeDescriptionCount = 1,
+       pVertexAttributeDescriptions = &kVertexAttributeDescription
+    );*/
+    vkh::VertexInputState vertex_input_state;
+
+    vkh::InputAssemblyState input_assembly_state(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP);
+    vkh::DynamicViewportState viewport_state;
+    const VkDynamicState kDynamicStates[] = {VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR};
+    vkh::PipelineDynamicStateCreateInfo F(dynamic_state,
+       dynamicStateCount = 2,
+       pDynamicStates = kDynamicStates
+    );
+
+    VkPushConstantRange push_constant_range = {VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(ViewPushConstants)};
+    vkh::PipelineLayoutCreateInfo F(pipeline_layout_info,
+       setLayoutCount = 1,
+       pSetLayouts = &descriptor_set_layout,
+       pushConstantRangeCount = 1,
+       pPushConstantRanges = &push_constant_range
+    );
+    pipeline_layout = vkh::CreatePipelineLayout(pipeline_layout_info);
+
+    vkh::AttachmentDescription F(color_attachment,
+       format = target_format,
+       finalLayout = target_final_layout
+    );
+
+    VkAttachmentReference F(color_reference,
+       attachment = 0,
+       layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL
+    );
+
+    vkh::SubpassDescription F(subpass,
+       colorAttachmentCount = 1,
+       pColorAttachments = &color_reference
+    );
+
+    vkh::SubpassDependency F(subpass_dependency,
+        srcSubpass = VK_SUBPASS_EXTERNAL,
+        srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+        dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+        dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT
+    );
+    // Offscreen targets are copied out after the render pass.
+    vkh::SubpassDependency F(readback_dependency,
+        srcSubpass = 0,
+        dstSubpass = VK_SUBPASS_EXTERNAL,
+        srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+        dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT,
+        srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+        dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+        dependencyFlags = 0
+    );
+    VkSubpassDependency subpass_dependencies[] = {subpass_dependency, readback_dependency};
+
+    vkh::RenderPassCreateInfo F(render_pass_info,
+       attachmentCount = 1,
+       pAttachments = &color_attachment,
+       subpassCount = 1,
+       pSubpasses = &subpass,
+       dependencyCount = headless ? 2u : 1u,
+       pDependencies = subpass_dependencies
+    );
+    render_pass = vkh::CreateRenderPass(render_pass_info);
+
+    vkh::GraphicsPipelineCreateInfo F(pipeline_info,
+       stageCount = pipeline_stages.size(),
+       pStages = pipeline_stages.data(),
+       pVertexInputState = &vertex_input_state,
+       pInputAssemblyState = &input_assembly_state,
+       pViewportState = &viewport_state,
+       pDynamicState = &dynamic_state,
+       layout = pipeline_layout,
+       renderPass = render_pass
+    );
+    graphics_pipeline = vkh::CreateGraphicsPipeline(device, pipeline_info);
+  }
+
+  void DestroyPipeline() {
+    vkDestroyPipeline(device, graphics_pipeline, nullptr);
+    vkDestroyPipelineLayout(device, pipeline_layout, nullptr);
+    vkDestroyRenderPass(device, render_pass, nullptr);
+    render_pass = VK_NULL_HANDLE;
+  }
+
+  // Creates a framebuffer for each of the current target images.
+  void CreateRenderTargets() {
+    for(auto& image_view : target_image_views) {
+      vkh::FramebufferCreateInfo F(framebuffer_info,
+          renderPass = render_pass,
+          attachmentCount = 1,
+          pAttachments = &image_view,
+          width = target_extent.width,
+          height = target_extent.height
+      );
+
+      framebuffers.push_back(vkh::CreateFramebuffer(framebuffer_info));
+    };
+  }
+
+  // Maps the view transform to a scale and offset of target coordinates.
+  // Integer scaling goes by how big the first layer's texels are on the
+  // target, so it's meant for layers that are all placed at the same scale.
+  ViewPushConstants ComputeViewPushConstants() const {
+    const ViewTransform& view = view_transform;
+    ViewPushConstants constants = {};
+    constants.nearest = view.filter != ViewFilter::kLinear;
+    float extent[2] = {(float)target_extent.width, (float)target_extent.height};
+    float center[2] = {view.center_x, view.center_y};
+    float layer_origin[2] = {layer_placements[0].x, layer_placements[0].y};
+    float texel_size[2] = {
+        layer_placements[0].width * extent[0] / bitmap_width,
+        layer_placements[0].height * extent[1] / bitmap_height};
+    for (int axis = 0; axis < 2; ++axis) {
+      float scale = view.zoom;
+      if (view.filter == ViewFilter::kIntegerNearest && texel_size[axis] > 0) {
+        scale = std::max(1.0f, std::round(texel_size[axis] * view.zoom)) / texel_size[axis];
+      }
+      float offset = 0.5f - center[axis] * scale;
+      if (view.filter == ViewFilter::kIntegerNearest) {
+        float origin = (layer_origin[axis] * scale + offset) * extent[axis];
+        offset += (std::round(origin) - origin) / extent[axis];
+      }
+      constants.scale[axis] = scale;
+      constants.offset[axis] = offset;
+    }
+    return constants;
+  }
+
+  // Records the draws for bands [first, last) with everything they need
+  // bound, since secondary command buffers don't inherit any state.
+  void RecordDrawBands(VkCommandBuffer command_buffer, uint32_t frame, uint32_t first, uint32_t last) {
+    vkh::Viewport viewport(target_extent);
+    ViewPushConstants view = ComputeViewPushConstants();
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphics_pipeline);
+    vkCmdSetViewport(command_buffer, 0, 1, &viewport);
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout, 0, 1, &descriptor_sets[frame], 0, nullptr);
+    vkCmdPushConstants(command_buffer, pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(view), &view);
+    uint32_t band_count = recording_options.draw_count;
+    for (uint32_t band = first; band < last; ++band) {
+      uint32_t top = (uint64_t)target_extent.height * band / band_count;
+      uint32_t bottom = (uint64_t)target_extent.height * (band + 1) / band_count;
+      VkRect2D scissor = {{0, (int32_t)top}, {target_extent.width, bottom - top}};
+      vkCmdSetScissor(command_buffer, 0, 1, &scissor);
+      vkCmdDraw(command_buffer, 4, instance_counts[frame], 0, 0);
+    }
+  }
+
+  // Records a chunk of the frame's bands into its secondary command buffer.
+  // Runs on the recording threads.
+  void RecordDrawChunk(uint32_t frame, uint32_t chunk, uint32_t image_index) {
+    uint32_t chunk_count = secondary_command_buffers[frame].size();
+    VkCommandBuffer command_buffer = secondary_command_buffers[frame][chunk];
+    vkResetCommandPool(device, secondary_command_pools[frame][chunk], 0);
+
+    vkh::CommandBufferInheritanceInfo F(inheritance_info,
+        renderPass = render_pass,
+        subpass = 0,
+        framebuffer = framebuffers[image_index]
+    );
+    vkh::CommandBufferBeginInfo begin_info;
+    begin_info.flags |= VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+    begin_info.pInheritanceInfo = &inheritance_info;
+    assert(vkBeginCommandBuffer(command_buffer, &begin_info) == VK_SUCCESS);
+    uint32_t draw_count = recording_options.draw_count;
+    RecordDrawBands(command_buffer, frame, (uint64_t)draw_count * chunk / chunk_count, (uint64_t)draw_count * (chunk + 1) / chunk_count);
+    assert(vkEndCommandBuffer(command_buffer) == VK_SUCCESS);
+  }
+
+  void CreateSecondaryCommandBuffers() {
+    if (recording_options.threads <= 1) return;
+    recording_pool.reset(new ThreadPool(recording_options.threads));
+    secondary_command_pools.resize(MAX_IN_FLIGHT_FRAMES);
+    secondary_command_buffers.resize(MAX_IN_FLIGHT_FRAMES);
+    for (uint32_t frame=0; frame<MAX_IN_FLIGHT_FRAMES; ++frame) {
+      for (uint32_t chunk=0; chunk<recording_options.threads; ++chunk) {
+        vkh::CommandPoolCreateInfo pool_info(graphics_queue_family);
+        pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+        VkCommandPool pool = vkh::CreateCommandPool(pool_info);
+        vkh::CommandBufferAllocateInfo command_buffer_allocate_info(pool, 1);
+        command_buffer_allocate_info.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+        VkCommandBuffer command_buffer;
+        assert(vkAllocateCommandBuffers(device, &command_buffer_allocate_info, &command_buffer) == VK_SUCCESS);
+        secondary_command_pools[frame].push_back(pool);
+        secondary_command_buffers[frame].push_back(command_buffer);
+      }
+    }
+  }
+
+  void DestroySecondaryCommandBuffers() {
+    for (const auto& pools : secondary_command_pools) {
+      for (VkCommandPool pool : pools) {
+        vkDestroyCommandPool(device, pool, nullptr);
+      }
+    }
+    secondary_command_pools.clear();
+    secondary_command_buffers.clear();
+    recording_pool.reset();
+  }
+
+  // Records drawing the current frame's texture into a target image.
+  void RecordDraw(VkCommandBuffer command_buffer, uint32_t image_index) {
+    uint32_t frame = current_frame;
+    if (!timestamp_pools.empty()) {
+      vkCmdResetQueryPool(command_buffer, timestamp_pools[frame], kDrawBegin, 2);
+      vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, timestamp_pools[frame], kDrawBegin);
+    }
+    if (SeparateTransferQueue()) {
+      RecordTextureAcquire(command_buffer, frame);
+    }
+
+    vkh::RenderPassBeginInfo render_pass_begin_info(render_pass, framebuffers[image_index], target_extent);
+    if (recording_pool) {
+      vkCmdBeginRenderPass(command_buffer, &render_pass_begin_info, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+      std::vector<VkCommandBuffer>& chunks = secondary_command_buffers[frame];
+      recording_pool->ParallelFor(chunks.size(), [&](size_t chunk) {
+        RecordDrawChunk(frame, chunk, image_index);
+      });
+      vkCmdExecuteCommands(command_buffer, chunks.size(), chunks.data());
+    } else {
+      vkCmdBeginRenderPass(command_buffer, &render_pass_begin_info, VK_SUBPASS_CONTENTS_INLINE);
+      RecordDrawBands(command_buffer, frame, 0, recording_options.draw_count);
+    }
+    vkCmdEndRenderPass(command_buffer);
+    if (!timestamp_pools.empty()) {
+      vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestamp_pools[frame], kDrawEnd);
+    }
+
+    // Headless frames draw into their own target.
+    if (readback) {
+      RecordReadback(command_buffer, image_index);
+    }
+    if (SeparateTransferQueue()) {
+      RecordTextureRelease(command_buffer, frame);
+    }
+  }
+
+  bool SeparateTransferQueue() const {
+    return !direct_textures && !encoded_input && transfer_queue_family != graphics_queue_family;
+  }
+
+  // Copies a region of each layer of a frame's staging slice into that
+  // frame's texture. When most of a layer changed we copy all of it, and when
+  // that's true of every layer, we also discard the texture's old contents
+  // instead of preserving them.
+  //
+  // With a separate transfer queue, the texture is acquired from and released
+  // back to the graphics queue around the copies. Those barriers pair with the
+  // ones recorded in the draw command buffers.
+  void RecordBitmapUpload(VkCommandBuffer command_buffer, uint32_t frame, const std::vector<DirtyRegion>& regions) {
+    VkImage texture_image = texture_images[frame];
+    bool full_upload = true;
+    for (const auto& region : regions) {
+      full_upload = full_upload && region.Coverage() > kFullUploadCoverage;
+    }
+
+    if (SeparateTransferQueue()) {
+      // A texture that's been drawn with was released by the graphics queue,
+      // and the submit waits on the semaphore signaled after that release.
+      bool acquire = textures_initialized[frame];
+      vkh::ImageMemoryBarrier F(acquire_barrier,
+          dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+          oldLayout = acquire ? VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_UNDEFINED,
+          newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+          srcQueueFamilyIndex = acquire ? (uint32_t)graphics_queue_family : VK_QUEUE_FAMILY_IGNORED,
+          dstQueueFamilyIndex = acquire ? (uint32_t)transfer_queue_family : VK_QUEUE_FAMILY_IGNORED,
+          image = texture_image
+      );
+      vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+          0, 0, nullptr, 0, nullptr, 1, &acquire_barrier);
+    } else {
+      bool discard = full_upload || !textures_initialized[frame];
+      vkh::ImageMemoryBarrier F(to_transfer_barrier,
+          srcAccessMask = 0,
+          dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+          oldLayout = discard ? VK_IMAGE_LAYOUT_UNDEFINED : VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+          newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+          image = texture_image
+      );
+      // Waits for the last frame that used this texture to finish sampling it.
+      vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+          0, 0, nullptr, 0, nullptr, 1, &to_transfer_barrier);
+    }
+
+    if (external_bitmap && external_options.type != ExternalMemoryType::kHostMemory) {
+      // Whoever wrote the slot released it to the external queue family.
+      vkh::BufferMemoryBarrier F(acquire_slot_barrier,
+          dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+          srcQueueFamilyIndex = VK_QUEUE_FAMILY_EXTERNAL,
+          dstQueueFamilyIndex = (uint32_t)(SeparateTransferQueue() ? transfer_queue_family : graphics_queue_family),
+          buffer = staging_buffer,
+          offset = StagingOffset(frame),
+          size = BitmapSize()
+      );
+      vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+          0, 0, nullptr, 1, &acquire_slot_barrier, 0, nullptr);
+    }
+
+    std::vector<VkBufferImageCopy> copy_regions;
+    for (uint32_t layer = 0; layer < layer_count; ++layer) {
+      const DirtyRegion& region = regions[layer];
+      VkDeviceSize staging_offset = StagingOffset(frame) + layer * LayerSize();
+      if (region.Coverage() > kFullUploadCoverage) {
+        vkh::BufferImageCopy copy_region({bitmap_width, bitmap_height});
+        copy_region.bufferOffset = staging_offset;
+        copy_region.imageSubresource.baseArrayLayer = layer;
+        copy_regions.push_back(copy_region);
+        continue;
+      }
+      for (const auto& rect : region.Rects()) {
+        vkh::BufferImageCopy copy_region({(int32_t)rect.x, (int32_t)rect.y}, {rect.width, rect.height});
+        copy_region.bufferOffset = staging_offset + (rect.y * bitmap_width + rect.x) * 4;
+        copy_region.bufferRowLength = bitmap_width;
+        copy_region.imageSubresource.baseArrayLayer = layer;
+        copy_regions.push_back(copy_region);
+      }
+    }
+    if (!copy_regions.empty()) {
+      vkCmdCopyBufferToImage(command_buffer, staging_buffer, texture_image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, copy_regions.size(), copy_regions.data());
+    }
+
+    if (SeparateTransferQueue()) {
+      vkh::ImageMemoryBarrier F(release_barrier,
+          srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+          oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+          newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+          srcQueueFamilyIndex = (uint32_t)transfer_queue_family,
+          dstQueueFamilyIndex = (uint32_t)graphics_queue_family,
+          image = texture_image
+      );
+      vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+          0, 0, nullptr, 0, nullptr, 1, &release_barrier);
+    } else {
+      vkh::ImageMemoryBarrier F(to_sampled_barrier,
+          srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+          dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+          oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+          newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+          image = texture_image
+      );
+      vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+          0, 0, nullptr, 0, nullptr, 1, &to_sampled_barrier);
+    }
+  }
+
+  // The graphics queue's half of the ownership transfers in RecordBitmapUpload.
+  void RecordTextureAcquire(VkCommandBuffer command_buffer, uint32_t frame) {
+    vkh::ImageMemoryBarrier F(acquire_barrier,
+        dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+        oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+        srcQueueFamilyIndex = (uint32_t)transfer_queue_family,
+        dstQueueFamilyIndex = (uint32_t)graphics_queue_family,
+        image = texture_images[frame]
+    );
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+        0, 0, nullptr, 0, nullptr, 1, &acquire_barrier);
+  }
+
+  void RecordTextureRelease(VkCommandBuffer command_buffer, uint32_t frame) {
+    vkh::ImageMemoryBarrier F(release_barrier,
+        oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+        newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        srcQueueFamilyIndex = (uint32_t)graphics_queue_family,
+        dstQueueFamilyIndex = (uint32_t)transfer_queue_family,
+        image = texture_images[frame]
+    );
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+        0, 0, nullptr, 0, nullptr, 1, &release_barrier);
+  }
+
+  uint8_t* StagingSlice(uint32_t frame) {
+    return staging_data + frame * BitmapSize();
+  }
+
+  VkDeviceSize ExternalSlotStride() const {
+    return external_options.slot_stride ? external_options.slot_stride : BitmapSize();
+  }
+
+  // Where the bitmap a frame uploads from starts in the staging buffer.
+  VkDeviceSize StagingOffset(uint32_t frame) const {
+    if (external_bitmap) {
+      return frame_external_slots[frame] * ExternalSlotStride();
+    }
+    return frame * BitmapSize();
+  }
+
+  // Imports the external memory as the staging buffer.
+  void ImportExternalBitmap() {
+    const ExternalBitmapOptions& options = external_options;
+    VkDeviceSize stride = ExternalSlotStride();
+    assert(options.fd != -1 && options.slot_count > 0);
+    assert(stride >= BitmapSize() && stride % 4 == 0);
+    VkDeviceSize size = stride * (options.slot_count - 1) + BitmapSize();
+    int fd = dup(options.fd);
+    assert(fd != -1);
+
+    if (options.type == ExternalMemoryType::kHostMemory) {
+      // Imports cover whole aligned pages, which the fd has to be big enough
+      // to back.
+      VkDeviceSize alignment = vkh::ImportedHostPointerAlignment();
+      size = options.size ? options.size : (size + alignment - 1) / alignment * alignment;
+      assert(size % alignment == 0);
+      external_mapping_size = size;
+      // Some drivers pin imported pages for writing, even though we only
+      // ever read them.
+      external_mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      close(fd);
+      assert(external_mapping != MAP_FAILED);
+      assert(reinterpret_cast<uintptr_t>(external_mapping) % alignment == 0);
+      staging_buffer = vkh::ImportHostBuffer(external_mapping, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, &external_memory);
+    } else {
+      // Exported allocations are imported whole.
+      size = options.size ? options.size : size;
+      external_mapping = nullptr;
+      auto handle_type = options.type == ExternalMemoryType::kOpaqueFd ?
+          VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT : VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
+      staging_buffer = vkh::ImportFdBuffer(fd, handle_type, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, &external_memory);
+    }
+    assert(stride * (options.slot_count - 1) + BitmapSize() <= size);
+    assert(external_slot < options.slot_count);
+    frame_external_slots.assign(MAX_IN_FLIGHT_FRAMES, -1);
+  }
+
+  uint32_t CodecTilesX() const {
+    return (bitmap_width + kCodecTileSize - 1) / kCodecTileSize;
+  }
+
+  uint32_t CodecTileCount() const {
+    return CodecTilesX() * ((bitmap_height + kCodecTileSize - 1) / kCodecTileSize);
+  }
+
+  // A table entry for every tile, followed by room for the longest runs each
+  // tile can have. Rounded up so every slice can be bound as a storage buffer.
+  VkDeviceSize EncodedSliceSize() const {
+    VkDeviceSize size = (VkDeviceSize)CodecTileCount() * (sizeof(EncodedTile) + kMaxTileWords * sizeof(uint32_t));
+    VkDeviceSize alignment = std::max<VkDeviceSize>(vkh::GetPhysicalDeviceCache().properties.limits.minStorageBufferOffsetAlignment, 4);
+    return (size + alignment - 1) / alignment * alignment;
+  }
+
+  EncodedTile* EncodedTable(uint32_t frame) {
+    return reinterpret_cast<EncodedTile*>(staging_data + frame * EncodedSliceSize());
+  }
+
+  uint32_t* EncodedWords(uint32_t frame) {
+    return reinterpret_cast<uint32_t*>(EncodedTable(frame) + CodecTileCount());
+  }
+
+  void CreateDecoder() {
+    VkDescriptorSetLayoutBinding bindings[] = {
+        vkh::DescriptorSetLayoutBinding(0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT),
+        vkh::DescriptorSetLayoutBinding(1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT),
+        vkh::DescriptorSetLayoutBinding(2, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT),
+    };
+    vkh::DescriptorSetLayoutCreateInfo F(set_layout_info,
+        bindingCount = 3,
+        pBindings = bindings
+    );
+    decode_set_layout = vkh::CreateDescriptorSetLayout(set_layout_info);
+
+    VkDescriptorPoolSize pool_sizes[] = {
+        {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, MAX_IN_FLIGHT_FRAMES},
+        {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, MAX_IN_FLIGHT_FRAMES},
+        {VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, MAX_IN_FLIGHT_FRAMES},
+    };
+    vkh::DescriptorPoolCreateInfo F(pool_info,
+        maxSets = MAX_IN_FLIGHT_FRAMES,
+        poolSizeCount = 3,
+        pPoolSizes = pool_sizes
+    );
+    decode_pool = vkh::CreateDescriptorPool(pool_info);
+
+    // Each frame decodes from its own slice, onto the previous frame's texture.
+    for (uint32_t i = 0; i < MAX_IN_FLIGHT_FRAMES; ++i) {
+      uint32_t previous_frame = (i + MAX_IN_FLIGHT_FRAMES - 1) % MAX_IN_FLIGHT_FRAMES;
+      VkDescriptorSet decode_set = vkh::AllocateDescriptorSet(decode_pool, decode_set_layout);
+      VkDescriptorBufferInfo encoded_info = {staging_buffer, i * EncodedSliceSize(), EncodedSliceSize()};
+      VkDescriptorImageInfo previous_info = {texture_sampler, texture_views[previous_frame], VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL};
+      VkDescriptorImageInfo bitmap_info = {VK_NULL_HANDLE, texture_views[i], VK_IMAGE_LAYOUT_GENERAL};
+      vkh::WriteDescriptorSet F(encoded_write,
+          dstSet = decode_set,
+          dstBinding = 0,
+          descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+          pBufferInfo = &encoded_info
+      );
+      vkh::WriteDescriptorSet F(previous_write,
+          dstSet = decode_set,
+          dstBinding = 1,
+          descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+          pImageInfo = &previous_info
+      );
+      vkh::WriteDescriptorSet F(bitmap_write,
+          dstSet = decode_set,
+          dstBinding = 2,
+          descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+          pImageInfo = &bitmap_info
+      );
+      VkWriteDescriptorSet descriptor_writes[] = {encoded_write, previous_write, bitmap_write};
+      vkUpdateDescriptorSets(device, 3, descriptor_writes, 0, nullptr);
+      decode_sets.push_back(decode_set);
+    }
+
+    VkPushConstantRange push_constant_range = {VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(DecodePushConstants)};
+    vkh::PipelineLayoutCreateInfo F(pipeline_layout_info,
+       setLayoutCount = 1,
+       pSetLayouts = &decode_set_layout,
+       pushConstantRangeCount = 1,
+       pPushConstantRanges = &push_constant_range
+    );
+    decode_pipeline_layout = vkh::CreatePipelineLayout(pipeline_layout_info);
+
+    vkh::PipelineShaderStageCreateInfo F(decode_stage_info,
+       stage = VK_SHADER_STAGE_COMPUTE_BIT,
+       module = decode_module
+    );
+    vkh::ComputePipelineCreateInfo F(pipeline_info,
+       stage = decode_stage_info,
+       layout = decode_pipeline_layout
+    );
+    assert(vkCreateComputePipelines(device, vkh::pipeline_cache, 1, &pipeline_info, nullptr, &decode_pipeline) == VK_SUCCESS);
+
+    encoded_tile_counts.assign(MAX_IN_FLIGHT_FRAMES, 0);
+    encoded_sizes.assign(MAX_IN_FLIGHT_FRAMES, 0);
+    tiles_listed.assign(CodecTileCount(), false);
+  }
+
+  void DestroyDecoder() {
+    vkDestroyPipeline(device, decode_pipeline, nullptr);
+    vkDestroyPipelineLayout(device, decode_pipeline_layout, nullptr);
+    vkDestroyDescriptorPool(device, decode_pool, nullptr);
+    vkDestroyDescriptorSetLayout(device, decode_set_layout, nullptr);
+    decode_sets.clear();
+  }
+
+  // Encoded frames are deltas against the one before, and the first one is
+  // against all zeros.
+  void ClearEncodedTextures() {
+    VkCommandBuffer command_buffer;
+    vkh::CommandBufferAllocateInfo command_buffer_allocate_info(command_pool, 1);
+    assert(vkAllocateCommandBuffers(device, &command_buffer_allocate_info, &command_buffer) == VK_SUCCESS);
+    vkh::CommandBufferBeginInfo begin_info;
+    assert(vkBeginCommandBuffer(command_buffer, &begin_info) == VK_SUCCESS);
+    for (VkImage texture_image : texture_images) {
+      vkh::ImageMemoryBarrier F(clear_barrier,
+          dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+          oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+          newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+          image = texture_image
+      );
+      vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+          0, 0, nullptr, 0, nullptr, 1, &clear_barrier);
+      VkClearColorValue zero = {};
+      vkh::ImageSubresourceRange range(VK_IMAGE_ASPECT_COLOR_BIT);
+      vkCmdClearColorImage(command_buffer, texture_image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &zero, 1, &range);
+      vkh::ImageMemoryBarrier F(sampled_barrier,
+          srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+          dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+          oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+          newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+          image = texture_image
+      );
+      vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+          0, 0, nullptr, 0, nullptr, 1, &sampled_barrier);
+    }
+    assert(vkEndCommandBuffer(command_buffer) == VK_SUCCESS);
+
+    vkh::SubmitInfo F(submit_info,
+        commandBufferCount = 1,
+        pCommandBuffers = &command_buffer
+    );
+    assert(vkQueueSubmit(graphics_queue, 1, &submit_info, VK_NULL_HANDLE) == VK_SUCCESS);
+    vkQueueWaitIdle(graphics_queue);
+    vkFreeCommandBuffers(device, command_pool, 1, &command_buffer);
+  }
+
+  // Adds every tile a region touches that isn't in the frame's table yet,
+  // with no runs.
+  void ListStaleTiles(uint32_t frame, const DirtyRegion& region) {
+    EncodedTile* table = EncodedTable(frame);
+    uint32_t& tile_count = encoded_tile_counts[frame];
+    for (const auto& rect : region.Rects()) {
+      for (uint32_t tile_y = rect.y / kCodecTileSize; tile_y <= (rect.Bottom() - 1) / kCodecTileSize; ++tile_y) {
+        for (uint32_t tile_x = rect.x / kCodecTileSize; tile_x <= (rect.Right() - 1) / kCodecTileSize; ++tile_x) {
+          uint32_t tile = tile_y * CodecTilesX() + tile_x;
+          if (tiles_listed[tile]) continue;
+          tiles_listed[tile] = true;
+          table[tile_count++] = {tile_x | tile_y << 16, 0, 0};
+        }
+      }
+    }
+    for (uint32_t i = 0; i < tile_count; ++i) {
+      tiles_listed[(table[i].position >> 16) * CodecTilesX() + (table[i].position & 0xffff)] = false;
+    }
+  }
+
+  // Decodes a frame's table into its texture. Reading the previous frame's
+  // texture waits for its decode, and writing this one waits for the last
+  // frames that sampled it or decoded from it.
+  void RecordDecode(VkCommandBuffer command_buffer, uint32_t frame, const std::vector<DirtyRegion>& regions) {
+    ListStaleTiles(frame, regions[0]);
+    uint32_t tile_count = encoded_tile_counts[frame];
+    if (tile_count == 0) return;
+
+    vkh::MemoryBarrier F(previous_barrier,
+        srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+        dstAccessMask = VK_ACCESS_SHADER_READ_BIT
+    );
+    vkh::ImageMemoryBarrier F(to_general_barrier,
+        dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+        oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+        newLayout = VK_IMAGE_LAYOUT_GENERAL,
+        image = texture_images[frame]
+    );
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        0, 1, &previous_barrier, 0, nullptr, 1, &to_general_barrier);
+
+    DecodePushConstants push_constants = {bitmap_width, bitmap_height, tile_count,
+        (uint32_t)(CodecTileCount() * sizeof(EncodedTile) / sizeof(uint32_t))};
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, decode_pipeline);
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, decode_pipeline_layout, 0, 1, &decode_sets[frame], 0, nullptr);
+    vkCmdPushConstants(command_buffer, decode_pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(push_constants), &push_constants);
+    vkCmdDispatch(command_buffer, (tile_count + 63) / 64, 1, 1);
+
+    vkh::ImageMemoryBarrier F(to_sampled_barrier,
+        srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+        dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+        oldLayout = VK_IMAGE_LAYOUT_GENERAL,
+        newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+        image = texture_images[frame]
+    );
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+        0, 0, nullptr, 0, nullptr, 1, &to_sampled_barrier);
+  }
+
+  // Everything the other in-flight frames changed in each layer since this
+  // frame's slice and texture were last written.
+  std::vector<DirtyRegion> StaleRegions(uint32_t frame) {
+    std::vector<DirtyRegion> stale(layer_count, DirtyRegion(bitmap_width, bitmap_height));
+    for (uint32_t i = 0; i < MAX_IN_FLIGHT_FRAMES; ++i) {
+      if (i == frame) continue;
+      for (uint32_t layer = 0; layer < layer_count; ++layer) {
+        stale[layer].Add(dirty_regions[i][layer]);
+      }
+    }
+    return stale;
+  }
+
+  // Brings a slice up to date by copying the stale regions out of the
+  // previous frame's slice, which is always current.
+  void CarryForwardStagingSlice(uint32_t frame, const std::vector<DirtyRegion>& stale) {
+    uint32_t previous_frame = (frame + MAX_IN_FLIGHT_FRAMES - 1) % MAX_IN_FLIGHT_FRAMES;
+    for (uint32_t layer = 0; layer < layer_count; ++layer) {
+      uint8_t* source = StagingSlice(previous_frame) + layer * LayerSize();
+      uint8_t* destination = StagingSlice(frame) + layer * LayerSize();
+      if (stale[layer].Coverage() > kFullUploadCoverage) {
+        memcpy(destination, source, LayerSize());
+        continue;
+      }
+      for (const auto& rect : stale[layer].Rects()) {
+        for (uint32_t y = rect.y; y < rect.Bottom(); ++y) {
+          size_t offset = (y * bitmap_width + rect.x) * 4;
+          memcpy(destination + offset, source + offset, rect.width * 4);
+        }
+      }
+    }
+  }
+
+  // Copies the visible layers' placements into the frame's instance buffer.
+  // The frame's fence must have signaled.
+  void WriteLayerInstances(uint32_t frame) {
+    uint32_t count = 0;
+    for (const auto& placement : layer_placements) {
+      if (placement.width > 0 && placement.height > 0) {
+        instance_data[frame][count++] = placement;
+      }
+    }
+    instance_counts[frame] = count;
+  }
+
+  // Lays the layers out in a grid that's as close to square as it can be,
+  // row by row. A single layer fills the target.
+  void PlaceLayersInGrid() {
+    uint32_t columns = 1;
+    while (columns * columns < layer_count) ++columns;
+    uint32_t rows = (layer_count + columns - 1) / columns;
+    layer_placements.resize(layer_count);
+    for (uint32_t layer = 0; layer < layer_count; ++layer) {
+      SetLayerPlacement(layer, (float)(layer % columns) / columns, (float)(layer / columns) / rows, 1.0f / columns, 1.0f / rows);
+    }
+  }
+
+  // Copies a region of the host bitmap into a frame's mapped texture. Each
+  // row is one sequential write, which is what write-combined memory wants.
+  void WriteDirectTexture(uint32_t frame, const DirtyRegion& region) {
+    for (const auto& rect : region.Rects()) {
+      for (uint32_t y = rect.y; y < rect.Bottom(); ++y) {
+        memcpy(texture_data[frame] + y * texture_row_pitch + rect.x * 4,
+               host_bitmap.data() + (y * bitmap_width + rect.x) * 4, rect.width * 4);
+      }
+    }
+  }
+
+  // Creates the textures for direct writes. Returns false, having created
+  // nothing, if the device can't sample linear images out of mappable device
+  // local memory.
+  bool CreateDirectTextures() {
+    VkFormatProperties format_properties;
+    vkGetPhysicalDeviceFormatProperties(physical_device, VK_FORMAT_R8G8B8A8_UNORM, &format_properties);
+    if (!(format_properties.linearTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT)) {
+      return false;
+    }
+    // Linear images can have much smaller limits than maxImageDimension2D.
+    VkImageFormatProperties image_format_properties;
+    if (vkGetPhysicalDeviceImageFormatProperties(physical_device, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_TYPE_2D,
+            VK_IMAGE_TILING_LINEAR, VK_IMAGE_USAGE_SAMPLED_BIT, 0, &image_format_properties) != VK_SUCCESS ||
+        image_format_properties.maxExtent.width < bitmap_width || image_format_properties.maxExtent.height < bitmap_height) {
+      return false;
+    }
+
+    const vkh::MemoryPreference kDirectMemory = {
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 0};
+    vkh::ImageCreateInfo F(image_info,
+        extent.width = bitmap_width,
+        extent.height = bitmap_height,
+        format = VK_FORMAT_R8G8B8A8_UNORM,
+        tiling = VK_IMAGE_TILING_LINEAR,
+        usage = VK_IMAGE_USAGE_SAMPLED_BIT,
+        initialLayout = VK_IMAGE_LAYOUT_PREINITIALIZED
+    );
+
+    for (uint32_t i=0; i<MAX_IN_FLIGHT_FRAMES; ++i) {
+      VkImage texture_image = vkh::CreateImage(image_info);
+      VkMemoryRequirements memory_requirements;
+      vkGetImageMemoryRequirements(device, texture_image, &memory_requirements);
+
+      // Identical images have identical requirements, so only the first
+      // texture can fail here.
+      int32_t memory_type = vkh::FindMemoryType(memory_requirements.memoryTypeBits, kDirectMemory);
+      if (memory_type == -1) {
+        vkDestroyImage(device, texture_image, nullptr);
+        return false;
+      }
+      vkh::Allocation texture_memory = vkh::memory_allocator.Allocate(memory_type, true, memory_requirements);
+      assert(vkBindImageMemory(device, texture_image, texture_memory.memory, texture_memory.offset) == VK_SUCCESS);
+
+      VkImageSubresource subresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0};
+      VkSubresourceLayout layout;
+      vkGetImageSubresourceLayout(device, texture_image, &subresource, &layout);
+      texture_row_pitch = layout.rowPitch;
+
+      texture_images.push_back(texture_image);
+      texture_memories.push_back(texture_memory);
+      texture_data.push_back(static_cast<uint8_t*>(vkh::MapMemory(texture_memory)) + layout.offset);
+    }
+
+    // Direct textures are only ever written by the host, so they move to the
+    // general layout once and stay there.
+    VkCommandBuffer command_buffer;
+    vkh::CommandBufferAllocateInfo command_buffer_allocate_info(command_pool, 1);
+    assert(vkAllocateCommandBuffers(device, &command_buffer_allocate_info, &command_buffer) == VK_SUCCESS);
+    vkh::CommandBufferBeginInfo begin_info;
+    assert(vkBeginCommandBuffer(command_buffer, &begin_info) == VK_SUCCESS);
+    for (VkImage texture_image : texture_images) {
+      vkh::ImageMemoryBarrier F(general_barrier,
+          srcAccessMask = VK_ACCESS_HOST_WRITE_BIT,
+          dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+          oldLayout = VK_IMAGE_LAYOUT_PREINITIALIZED,
+          newLayout = VK_IMAGE_LAYOUT_GENERAL,
+          image = texture_image
+      );
+      vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_HOST_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+          0, 0, nullptr, 0, nullptr, 1, &general_barrier);
+    }
+    assert(vkEndCommandBuffer(command_buffer) == VK_SUCCESS);
+
+    vkh::SubmitInfo F(submit_info,
+        commandBufferCount = 1,
+        pCommandBuffers = &command_buffer
+    );
+    assert(vkQueueSubmit(graphics_queue, 1, &submit_info, VK_NULL_HANDLE) == VK_SUCCESS);
+    vkQueueWaitIdle(graphics_queue);
+    vkFreeCommandBuffers(device, command_pool, 1, &command_buffer);
+    return true;
+  }
+
+  // A pool and command buffer for each in-flight frame. The pools are reset
+  // as a whole, so their buffers are transient.
+  void CreateFrameCommandBuffers(int32_t queue_family, std::vector<VkCommandPool>* pools, std::vector<VkCommandBuffer>* command_buffers) {
+    for (uint32_t i=0; i<MAX_IN_FLIGHT_FRAMES; ++i) {
+      vkh::CommandPoolCreateInfo pool_info(queue_family);
+      pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+      VkCommandPool pool = vkh::CreateCommandPool(pool_info);
+      VkCommandBuffer command_buffer;
+      vkh::CommandBufferAllocateInfo command_buffer_allocate_info(pool, 1);
+      assert(vkAllocateCommandBuffers(device, &command_buffer_allocate_info, &command_buffer) == VK_SUCCESS);
+      pools->push_back(pool);
+      command_buffers->push_back(command_buffer);
+    }
+  }
+
+  void DestroyFrameCommandBuffers(std::vector<VkCommandPool>* pools, std::vector<VkCommandBuffer>* command_buffers) {
+    for (VkCommandPool pool : *pools) {
+      vkDestroyCommandPool(device, pool, nullptr);
+    }
+    pools->clear();
+    command_buffers->clear();
+  }
+
+  void CreateBitmapTexture() {
+    const VkPhysicalDeviceLimits& limits = vkh::GetPhysicalDeviceCache().properties.limits;
+    assert(bitmap_width <= limits.maxImageDimension2D && bitmap_height <= limits.maxImageDimension2D);
+    assert(layer_count <= limits.maxImageArrayLayers);
+    direct_textures = memory_path == MemoryPath::kDirect && layer_count == 1 && !external_bitmap && !encoded_input &&
+        CreateDirectTextures();
+    if (direct_textures) {
+      host_bitmap.assign(BitmapSize(), 128);
+    } else {
+      VkImageUsageFlags texture_usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+      if (external_bitmap) {
+        ImportExternalBitmap();
+      } else if (encoded_input) {
+        // Only ever written by the host and read once by the decode.
+        VkDeviceSize staging_size = EncodedSliceSize() * MAX_IN_FLIGHT_FRAMES;
+        staging_buffer = vkh::CreateBuffer(staging_size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &staging_memory);
+        staging_data = static_cast<uint8_t*>(vkh::MapMemory(staging_memory));
+        texture_usage |= VK_IMAGE_USAGE_STORAGE_BIT;
+      } else {
+        // Carrying a slice forward reads the previous one back.
+        VkDeviceSize staging_size = BitmapSize() * MAX_IN_FLIGHT_FRAMES;
+        staging_buffer = vkh::CreateBuffer(staging_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, kHostReadMemory, &staging_memory);
+
+        // The staging ring stays mapped for the life of the renderer.
+        staging_data = static_cast<uint8_t*>(vkh::MapMemory(staging_memory));
+        memset(staging_data, 128, staging_size);
+      }
+
+      for (uint32_t i=0; i<MAX_IN_FLIGHT_FRAMES; ++i) {
+        vkh::Allocation texture_memory;
+        texture_images.push_back(vkh::CreateImage(bitmap_width, bitmap_height, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_TILING_OPTIMAL, texture_usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &texture_memory, layer_count));
+        texture_memories.push_back(texture_memory);
+      }
+    }
+
+    // Nearest filtering is done in the fragment shader, so the view filter
+    // can change without touching the descriptors.
+    vkh::SamplerCreateInfo F(sampler_info,
+        magFilter = VK_FILTER_LINEAR,
+        minFilter = VK_FILTER_LINEAR
+    );
+    texture_sampler = vkh::CreateSampler(sampler_info);
+
+    VkDescriptorSetLayoutBinding bindings[] = {
+        vkh::DescriptorSetLayoutBinding(0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT),
+        vkh::DescriptorSetLayoutBinding(1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_VERTEX_BIT),
+    };
+    vkh::DescriptorSetLayoutCreateInfo F(descriptor_set_layout_info,
+        bindingCount = 2,
+        pBindings = bindings
+    );
+    descriptor_set_layout = vkh::CreateDescriptorSetLayout(descriptor_set_layout_info);
+
+    VkDescriptorPoolSize pool_sizes[] = {
+        {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, MAX_IN_FLIGHT_FRAMES},
+        {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, MAX_IN_FLIGHT_FRAMES},
+    };
+    vkh::DescriptorPoolCreateInfo F(descriptor_pool_info,
+        maxSets = MAX_IN_FLIGHT_FRAMES,
+        poolSizeCount = 2,
+        pPoolSizes = pool_sizes
+    );
+    descriptor_pool = vkh::CreateDescriptorPool(descriptor_pool_info);
+
+    VkImageLayout texture_layout = direct_textures ? VK_IMAGE_LAYOUT_GENERAL : VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    for (uint32_t i=0; i<MAX_IN_FLIGHT_FRAMES; ++i) {
+      vkh::ImageViewCreateInfo F(texture_view_info,
+          image = texture_images[i],
+          viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY,
+          format = VK_FORMAT_R8G8B8A8_UNORM
+      );
+      VkImageView texture_view = vkh::CreateImageView(texture_view_info);
+      VkDescriptorSet descriptor_set = vkh::AllocateDescriptorSet(descriptor_pool, descriptor_set_layout);
+
+      vkh::Allocation instance_memory;
+      VkDeviceSize instance_size = sizeof(LayerInstance) * layer_count;
+      VkBuffer instance_buffer = vkh::CreateBuffer(instance_size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &instance_memory);
+
+      VkDescriptorImageInfo image_info = {texture_sampler, texture_view, texture_layout};
+      VkDescriptorBufferInfo instance_info = {instance_buffer, 0, instance_size};
+      vkh::WriteDescriptorSet F(image_write,
+          dstSet = descriptor_set,
+          dstBinding = 0,
+          descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+          pImageInfo = &image_info
+      );
+      vkh::WriteDescriptorSet F(instance_write,
+          dstSet = descriptor_set,
+          dstBinding = 1,
+          descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+          pBufferInfo = &instance_info
+      );
+      VkWriteDescriptorSet descriptor_writes[] = {image_write, instance_write};
+      vkUpdateDescriptorSets(device, 2, descriptor_writes, 0, nullptr);
+
+      instance_buffers.push_back(instance_buffer);
+      instance_memories.push_back(instance_memory);
+      instance_data.push_back(static_cast<LayerInstance*>(vkh::MapMemory(instance_memory)));
+
+      texture_views.push_back(texture_view);
+      descriptor_sets.push_back(descriptor_set);
+      upload_finished_semaphores.push_back(vkh::CreateSemaphore(device));
+      texture_released_semaphores.push_back(vkh::CreateSemaphore(device));
+    }
+    textures_initialized.assign(MAX_IN_FLIGHT_FRAMES, false);
+    instance_counts.assign(MAX_IN_FLIGHT_FRAMES, 0);
+    if (encoded_input) {
+      ClearEncodedTextures();
+      textures_initialized.assign(MAX_IN_FLIGHT_FRAMES, true);
+      CreateDecoder();
+    }
+
+    if (SeparateTransferQueue()) {
+      CreateFrameCommandBuffers(transfer_queue_family, &transfer_command_pools, &upload_command_buffers);
+    }
+
+    dirty_regions.assign(MAX_IN_FLIGHT_FRAMES, std::vector<DirtyRegion>(layer_count, DirtyRegion(bitmap_width, bitmap_height)));
+  }
+
+  void DestroyBitmapTexture() {
+    if (encoded_input) {
+      DestroyDecoder();
+    }
+    DestroyFrameCommandBuffers(&transfer_command_pools, &upload_command_buffers);
+    for (uint32_t i=0; i<MAX_IN_FLIGHT_FRAMES; ++i) {
+      vkDestroySemaphore(device, upload_finished_semaphores[i], nullptr);
+      vkDestroySemaphore(device, texture_released_semaphores[i], nullptr);
+      vkDestroyImageView(device, texture_views[i], nullptr);
+      vkDestroyImage(device, texture_images[i], nullptr);
+      vkh::FreeMemory(texture_memories[i]);
+      vkDestroyBuffer(device, instance_buffers[i], nullptr);
+      vkh::FreeMemory(instance_memories[i]);
+    }
+    upload_finished_semaphores.clear();
+    texture_released_semaphores.clear();
+    texture_views.clear();
+    texture_images.clear();
+    texture_memories.clear();
+    texture_data.clear();
+    instance_buffers.clear();
+    instance_memories.clear();
+    instance_data.clear();
+    descriptor_sets.clear();
+
+    vkDestroyDescriptorPool(device, descriptor_pool, nullptr);
+    vkDestroyDescriptorSetLayout(device, descriptor_set_layout, nullptr);
+    vkDestroySampler(device, texture_sampler, nullptr);
+    if (direct_textures) {
+      host_bitmap.clear();
+    } else if (external_bitmap) {
+      vkDestroyBuffer(device, staging_buffer, nullptr);
+      vkFreeMemory(device, external_memory, nullptr);
+      if (external_mapping) {
+        munmap(external_mapping, external_mapping_size);
+      }
+    } else {
+      vkDestroyBuffer(device, staging_buffer, nullptr);
+      vkh::FreeMemory(staging_memory);
+    }
+  }
+
+  // Creates the instance, and for windowed runs, a debug report callback if
+  // the validation layer is installed. Machines without it, like most CI
+  // boxes, run without either.
+  void CreateInstance() {
+    vkh::ApplicationInfo F(app_info,
+        pApplicationName = "Affinity",
+        applicationVersion = 1,
+        pEngineName = "Ocelot Engine",
+        engineVersion = 1,
+        apiVersion = VK_API_VERSION_1_1
+    );
+
+    std::vector<const char*> extension_names;
+    if (!headless) {
+      uint32_t sdl_extension_count = 0;
+      // If this fails, vulkan is unsupported;
+      assert(SDL_Vulkan_GetInstanceExtensions(window, &sdl_extension_count, NULL));
+
+      extension_names.resize(sdl_extension_count);
+      assert(SDL_Vulkan_GetInstanceExtensions(window, &sdl_extension_count, extension_names.data()));
+      extension_names.push_back(VK_KHR_SURFACE_EXTENSION_NAME);
+    }
+
+    const char* kValidationLayer = "VK_LAYER_LUNARG_standard_validation";
+    bool validation = InstanceSupportsLayer(kValidationLayer);
+    std::vector<const char*> layer_names;
+    if (validation) {
+      layer_names.push_back(kValidationLayer);
+      extension_names.push_back(VK_EXT_DEBUG_REPORT_EXTENSION_NAME);
+    }
+
+    vkh::InstanceCreateInfo F(instance_info,
+        pApplicationInfo = &app_info,
+        enabledLayerCount = (uint32_t)layer_names.size(),
+        ppEnabledLayerNames = layer_names.data(),
+        enabledExtensionCount = (uint32_t)extension_names.size(),
+        ppEnabledExtensionNames = extension_names.data()
+    );
+
+    instance = vkh::CreateInstance(instance_info);
+
+    debug_callback = VK_NULL_HANDLE;
+    if (validation) {
+      VkDebugReportCallbackCreateInfoEXT create_info = {};
+      create_info.sType = VK_STRUCTURE_TYPE_DEBUG_REPORT_CALLBACK_CREATE_INFO_EXT;
+      create_info.flags = VK_DEBUG_REPORT_ERROR_BIT_EXT | VK_DEBUG_REPORT_WARNING_BIT_EXT;
+      create_info.pfnCallback = DebugCallback;
+
+      assert(CreateDebugReportCallbackEXT(instance, &create_info, nullptr, &debug_callback) == VK_SUCCESS);
+    }
+  }
+
+  void DestroyInstance() {
+    if (debug_callback != VK_NULL_HANDLE) {
+      DestroyDebugReportCallbackEXT(instance, debug_callback, nullptr);
+    }
+    vkDestroyInstance(instance, nullptr);
+  }
+
+  // Creates the device and everything that lives as long as it. Windowed
+  // runs must have created the surface already.
+  void CreateDevice() {
+    std::vector<const char*> device_extensions;
+    if (!headless) {
+      device_extensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+    }
+    if (external_bitmap && external_options.type == ExternalMemoryType::kHostMemory) {
+      device_extensions.push_back(VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME);
+    } else if (external_bitmap) {
+      device_extensions.push_back(VK_KHR_EXTERNAL_MEMORY_FD_EXTENSION_NAME);
+      if (external_options.type == ExternalMemoryType::kDmaBuf) {
+        device_extensions.push_back(VK_EXT_EXTERNAL_MEMORY_DMA_BUF_EXTENSION_NAME);
+      }
+    }
+    physical_device = ChoosePhysicalDevice(instance, surface, device_extensions);
+    vkh::physical_device = physical_device;
+
+    graphics_queue_family = GetQueueFamily(physical_device, VK_QUEUE_GRAPHICS_BIT);
+    // A transfer only family is usually backed by a copy engine. Graphics
+    // families can always do transfers, so fall back to ours.
+    transfer_queue_family = GetDedicatedQueueFamily(physical_device, VK_QUEUE_TRANSFER_BIT);
+    if (transfer_queue_family == -1) {
+      transfer_queue_family = graphics_queue_family;
+    }
+    std::set<int32_t> queue_families = {graphics_queue_family, transfer_queue_family};
+    assert(graphics_queue_family != -1);
+    assert(transfer_queue_family != -1);
+    if (!headless) {
+      present_queue_family = GetQueueFamilySupportingSurface(physical_device, surface);
+      assert(present_queue_family != -1);
+      queue_families.insert(present_queue_family);
+    }
+
+    // The vkh structs own their queue priorities, so they have to outlive the
+    // plain structs we hand to vkCreateDevice.
+    std::vector<vkh::DeviceQueueCreateInfo> queue_infos;
+    queue_infos.reserve(queue_families.size());
+    for(int32_t queue_family : queue_families) {
+      queue_infos.emplace_back(1);
+      queue_infos.back().queueFamilyIndex = queue_family;
+    }
+    std::vector<VkDeviceQueueCreateInfo> queue_create_infos(queue_infos.begin(), queue_infos.end());
+
+    vkh::DeviceCreateInfo F(device_info,
+        queueCreateInfoCount = queue_create_infos.size(),
+        pQueueCreateInfos = queue_create_infos.data(),
+        enabledExtensionCount = device_extensions.size(),
+        ppEnabledExtensionNames = device_extensions.data()
+    );
+    device = vkh::CreateDevice(physical_device, device_info);
+    vkh::device = device;
+
+    graphics_queue = vkh::GetDeviceQueue(device, graphics_queue_family, 0);
+    transfer_queue = vkh::GetDeviceQueue(device, transfer_queue_family, 0);
+    present_queue = headless ? VK_NULL_HANDLE : vkh::GetDeviceQueue(device, present_queue_family, 0);
+
+    vkh::CommandPoolCreateInfo command_pool_info(graphics_queue_family);
+    command_pool = vkh::CreateCommandPool(command_pool_info);
+    CreateFrameCommandBuffers(graphics_queue_family, &frame_command_pools, &frame_command_buffers);
+    CreateSecondaryCommandBuffers();
+
+    vkh::pipeline_cache = vkh::LoadPipelineCache(pipeline_cache_path);
+    vertex_module = h::ShaderModule(device, quad_vert_spv);
+    fragment_module = h::ShaderModule(device, quad_frag_spv);
+    if (encoded_input) {
+      decode_module = h::ShaderModule(device, decode_comp_spv);
+    }
+
+    CreateBitmapTexture();
+    CreateTimestampPools();
+    frame_number = 0;
+
+    for(uint32_t i=0; i<MAX_IN_FLIGHT_FRAMES; ++i) {
+      image_available_semaphores.push_back(vkh::CreateSemaphore(device));
+      render_finished_semaphores.push_back(vkh::CreateSemaphore(device));
+      in_flight_fences.push_back(vkh::CreateFence(device));
+    }
+  }
+
+  // Render targets must have been destroyed already.
+  void DestroyDevice() {
+    vkDeviceWaitIdle(device);
+
+    for(uint32_t i=0; i<MAX_IN_FLIGHT_FRAMES; ++i) {
+      vkDestroySemaphore(device, image_available_semaphores[i], nullptr);
+      vkDestroySemaphore(device, render_finished_semaphores[i], nullptr);
+      vkDestroyFence(device, in_flight_fences[i], nullptr);
+    }
+    image_available_semaphores.clear();
+    render_finished_semaphores.clear();
+    in_flight_fences.clear();
+
+    vkDestroyShaderModule(device, vertex_module, nullptr);
+    vkDestroyShaderModule(device, fragment_module, nullptr);
+    if (encoded_input) {
+      vkDestroyShaderModule(device, decode_module, nullptr);
+    }
+    if (!pipeline_cache_path.empty()) {
+      vkh::SavePipelineCache(vkh::pipeline_cache, pipeline_cache_path);
+    }
+    vkDestroyPipelineCache(device, vkh::pipeline_cache, nullptr);
+    vkh::pipeline_cache = VK_NULL_HANDLE;
+    DestroyTimestampPools();
+    DestroyBitmapTexture();
+    DestroySecondaryCommandBuffers();
+    DestroyFrameCommandBuffers(&frame_command_pools, &frame_command_buffers);
+    vkDestroyCommandPool(device, command_pool, nullptr);
+    vkh::memory_allocator.Destroy();
+    vkDestroyDevice(device, nullptr);
+  }
+
+  void DrawFrame(const DrawBitmapFunction& draw_bitmap) {
+    uint8_t* bitmap = BeginFrame();
+    draw_bitmap(bitmap, bitmap_width, bitmap_height);
+    EndFrame();
+  }
+
+public:
+  // Waits until the next frame's slot is free and returns its bitmap, which
+  // holds the previous frame. Only for windows opened with Open, where the
+  // caller runs the frame loop itself: draw into the bitmap, mark what
+  // changed with MarkDirty, and call EndFrame.
+  uint8_t* BeginFrame() {
+    FrameStats& stats = frame_stats;
+    stats = {};
+    stats.frame = frame_number++;
+    frame_start = Clock::now();
+    if (frame_pacing == FramePacing::kLowLatency) {
+      // Waits on the frame we just submitted. Running into the deadline
+      // just means we draw a frame early.
+      vkWaitForFences(device, 1, &in_flight_fences[current_frame], VK_TRUE, frame_deadline_ns);
+    }
+    current_frame = (current_frame + 1) % MAX_IN_FLIGHT_FRAMES;
+
+    // Once this frame's fence signals its staging slice is free, even if the
+    // GPU is still busy with the other in-flight frames.
+    vkWaitForFences(device, 1, &in_flight_fences[current_frame], VK_TRUE, std::numeric_limits<uint64_t>::max());
+    stats.fence_wait_ms = MillisecondsSince(frame_start);
+    CollectFinishedFrame(current_frame);
+    DestroyRetiredTargets(false);
+
+    Clock::time_point upload_start = Clock::now();
+    frame_upload_regions = StaleRegions(current_frame);
+    uint8_t* bitmap = host_bitmap.data();
+    if (external_bitmap) {
+      // The slot shown is always a whole frame, so there's nothing to carry
+      // forward.
+      bitmap = nullptr;
+    } else if (encoded_input) {
+      bitmap = nullptr;
+      encoded_tile_counts[current_frame] = 0;
+      encoded_sizes[current_frame] = 0;
+    } else if (!direct_textures) {
+      CarryForwardStagingSlice(current_frame, frame_upload_regions);
+      bitmap = StagingSlice(current_frame);
+    }
+    stats.upload_ms = MillisecondsSince(upload_start);
+
+    for (auto& region : dirty_regions[current_frame]) {
+      region.Clear();
+    }
+    draw_start = Clock::now();
+    return bitmap;
+  }
+
+  // Uploads what was marked dirty since BeginFrame and submits the frame.
+  // Windowed frames are presented, headless frames stay in their offscreen
+  // target.
+  void EndFrame() {
+    FrameStats& stats = frame_stats;
+    stats.draw_ms = MillisecondsSince(draw_start);
+
+    Clock::time_point upload_start = Clock::now();
+    std::vector<DirtyRegion>& upload_regions = frame_upload_regions;
+    std::vector<DirtyRegion>& dirty = dirty_regions[current_frame];
+    bool upload_empty = true;
+    stats.upload_bytes = 0;
+    for (uint32_t layer = 0; layer < layer_count; ++layer) {
+      DirtyRegion& upload_region = upload_regions[layer];
+      upload_region.Add(dirty[layer]);
+      if (!textures_initialized[current_frame]) {
+        upload_region.AddAll();
+      }
+      bool full_upload = !direct_textures && upload_region.Coverage() > kFullUploadCoverage;
+      stats.upload_bytes += full_upload ? LayerSize() : upload_region.Area() * 4;
+      upload_empty = upload_empty && upload_region.Empty();
+    }
+    if (encoded_input) {
+      stats.upload_bytes = encoded_sizes[current_frame];
+    }
+    if (direct_textures) {
+      WriteDirectTexture(current_frame, upload_regions[0]);
+      textures_initialized[current_frame] = true;
+    }
+    if (external_bitmap) {
+      frame_external_slots[current_frame] = external_slot;
+    }
+    WriteLayerInstances(current_frame);
+    stats.upload_ms += MillisecondsSince(upload_start);
+
+    VkSemaphore& wait_semaphore = image_available_semaphores[current_frame];
+    VkSemaphore& signal_semaphore = render_finished_semaphores[current_frame];
+
+    // Headless frames each have their own target.
+    uint32_t image_index = current_frame;
+    std::vector<VkSemaphore> wait_semaphores;
+    std::vector<VkPipelineStageFlags> wait_stages;
+    std::vector<VkSemaphore> signal_semaphores;
+    if (!headless) {
+      Clock::time_point acquire_start = Clock::now();
+      // A failed acquire doesn't signal the semaphore, so we retry with the
+      // new swapchain before submitting anything that waits on it.
+      VkResult result;
+      while ((result = vkAcquireNextImageKHR(device, swapchain, std::numeric_limits<uint64_t>::max(), wait_semaphore, VK_NULL_HANDLE, &image_index)) == VK_ERROR_OUT_OF_DATE_KHR) {
+        RecreateSwapchain();
+      }
+      assert(result == VK_SUCCESS || result == VK_SUBOPTIMAL_KHR);
+      stats.acquire_ms = MillisecondsSince(acquire_start);
+      wait_semaphores.push_back(wait_semaphore);
+      wait_stages.push_back(VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT);
+      signal_semaphores.push_back(signal_semaphore);
+    }
+
+    vkResetFences(device, 1, &in_flight_fences[current_frame]);
+
+    // The frame's fence has signaled, so nothing recorded from its pools is
+    // still running.
+    VkCommandBuffer command_buffer = frame_command_buffers[current_frame];
+    vkResetCommandPool(device, frame_command_pools[current_frame], 0);
+    vkh::CommandBufferBeginInfo begin_info;
+    assert(vkBeginCommandBuffer(command_buffer, &begin_info) == VK_SUCCESS);
+
+    // A separate transfer queue always runs the upload, even with nothing to
+    // copy, since it has to pass the texture back to the graphics queue.
+    bool uploads_timed_this_frame = false;
+    if (!direct_textures && (SeparateTransferQueue() || !upload_empty)) {
+      upload_start = Clock::now();
+      VkCommandBuffer upload_command_buffer = command_buffer;
+      if (SeparateTransferQueue()) {
+        upload_command_buffer = upload_command_buffers[current_frame];
+        vkResetCommandPool(device, transfer_command_pools[current_frame], 0);
+        assert(vkBeginCommandBuffer(upload_command_buffer, &begin_info) == VK_SUCCESS);
+      }
+      bool time_upload = !timestamp_pools.empty() && upload_timestamp_mask != 0;
+      if (time_upload) {
+        vkCmdResetQueryPool(upload_command_buffer, timestamp_pools[current_frame], kUploadBegin, 2);
+        vkCmdWriteTimestamp(upload_command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, timestamp_pools[current_frame], kUploadBegin);
+      }
+      if (encoded_input) {
+        RecordDecode(upload_command_buffer, current_frame, upload_regions);
+      } else {
+        RecordBitmapUpload(upload_command_buffer, current_frame, upload_regions);
+      }
+      if (time_upload) {
+        vkCmdWriteTimestamp(upload_command_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestamp_pools[current_frame], kUploadEnd);
+      }
+      uploads_timed_this_frame = time_upload;
+
+      if (SeparateTransferQueue()) {
+        assert(vkEndCommandBuffer(upload_command_buffer) == VK_SUCCESS);
+        // The first upload into a texture has nothing to acquire it from.
+        VkPipelineStageFlags transfer_wait_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+        vkh::SubmitInfo F(upload_submit_info,
+            waitSemaphoreCount = textures_initialized[current_frame] ? 1u : 0u,
+            pWaitSemaphores = &texture_released_semaphores[current_frame],
+            pWaitDstStageMask = &transfer_wait_stage,
+            signalSemaphoreCount = 1,
+            pSignalSemaphores = &upload_finished_semaphores[current_frame],
+            commandBufferCount = 1,
+            pCommandBuffers = &upload_command_buffer
+        );
+        assert(vkQueueSubmit(transfer_queue, 1, &upload_submit_info, VK_NULL_HANDLE) == VK_SUCCESS);
+        wait_semaphores.push_back(upload_finished_semaphores[current_frame]);
+        wait_stages.push_back(VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
+        signal_semaphores.push_back(texture_released_semaphores[current_frame]);
+      }
+      textures_initialized[current_frame] = true;
+      stats.upload_ms += MillisecondsSince(upload_start);
+    }
+    Clock::time_point record_start = Clock::now();
+    RecordDraw(command_buffer, image_index);
+    assert(vkEndCommandBuffer(command_buffer) == VK_SUCCESS);
+    stats.record_ms = MillisecondsSince(record_start);
+
+    vkh::SubmitInfo F(submit_info,
+        waitSemaphoreCount = (uint32_t)wait_semaphores.size(),
+        pWaitSemaphores = wait_semaphores.data(),
+        signalSemaphoreCount = (uint32_t)signal_semaphores.size(),
+        pSignalSemaphores = signal_semaphores.data(),
+        pWaitDstStageMask = wait_stages.data(),
+        commandBufferCount = 1,
+        pCommandBuffers = &command_buffer
+    );
+
+    assert(vkQueueSubmit(graphics_queue, 1, &submit_info, in_flight_fences[current_frame]) == VK_SUCCESS);
+    if (!timestamp_pools.empty()) {
+      timed_frames[current_frame] = stats.frame;
+      uploads_timed[current_frame] = uploads_timed_this_frame;
+      timings_pending[current_frame] = true;
+    }
+    if (headless) {
+      readback_pending[current_frame] = (bool)readback;
+    } else {
+      Clock::time_point present_start = Clock::now();
+      VkResult result = vkh::PresentQueue(present_queue, &signal_semaphore, &swapchain, &image_index);
+      if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR) {
+        RecreateSwapchain();
+      } else {
+        assert(result == VK_SUCCESS);
+      }
+      stats.present_ms = MillisecondsSince(present_start);
+    }
+
+    stats.frame_ms = MillisecondsSince(frame_start);
+    stats.cpu_ms = stats.frame_ms - stats.fence_wait_ms - stats.acquire_ms - stats.present_ms;
+    if (frame_stats_function) {
+      frame_stats_function(stats);
+    }
+  }
+
+  // Each of the layers is a bitmap_width x bitmap_height bitmap of its own,
+  // updated and placed independently. They're all drawn with one instanced
+  // draw, and start out in a grid covering the target.
+  BitmapRenderer(uint32_t bitmap_width = kDefaultBitmapWidth, uint32_t bitmap_height = kDefaultBitmapHeight, uint32_t layer_count = 1)
+      : bitmap_width(bitmap_width), bitmap_height(bitmap_height), layer_count(layer_count), external_bitmap(false),
+        encoded_input(false), memory_path(MemoryPath::kDirect), direct_textures(false) {
+    assert(layer_count > 0);
+    PlaceLayersInGrid();
+  }
+
+  // Past this fraction of a layer being dirty we copy all of it.
+  static constexpr double kFullUploadCoverage = 0.5;
+
+  uint32_t BitmapWidth() const {
+    return bitmap_width;
+  }
+
+  uint32_t BitmapHeight() const {
+    return bitmap_height;
+  }
+
+  uint32_t LayerCount() const {
+    return layer_count;
+  }
+
+  // The distance in bytes between layers in the DrawBitmapFunction's bitmap.
+  VkDeviceSize LayerSize() const {
+    return (VkDeviceSize)bitmap_width * bitmap_height * 4;
+  }
+
+  // All of the layers.
+  VkDeviceSize BitmapSize() const {
+    return LayerSize() * layer_count;
+  }
+
+  // Changes the bitmap's size, between frames of a window opened with Open.
+  // Waits for the GPU, and the bitmap's contents are lost, so the next frame
+  // has to draw and mark all of it.
+  void ResizeBitmap(uint32_t width, uint32_t height) {
+    vkDeviceWaitIdle(device);
+    CollectFinishedFrames();
+    DestroyTargets({}, framebuffers);
+    framebuffers.clear();
+    DestroyPipeline();
+    DestroyBitmapTexture();
+    bitmap_width = width;
+    bitmap_height = height;
+    CreateBitmapTexture();
+    CreatePipeline();
+    CreateRenderTargets();
+  }
+
+  // Uploads frames out of memory shared with a producer instead, and hands
+  // the DrawBitmapFunction a null bitmap. Each frame shows the slot last
+  // given to ShowExternalSlot, starting with slot 0, and marks what changed
+  // since the frame before it with MarkDirty, as if it had drawn it. Takes
+  // effect from the next run, which needs a device that can import the
+  // memory's type.
+  void SetExternalBitmap(const ExternalBitmapOptions& options) {
+    assert(!encoded_input);
+    external_bitmap = true;
+    external_options = options;
+    external_slot = 0;
+  }
+
+  // Only valid from inside the DrawBitmapFunction. The slot must hold a
+  // whole frame that the producer leaves alone until it's released.
+  void ShowExternalSlot(uint32_t slot) {
+    assert(external_bitmap && slot < external_options.slot_count);
+    external_slot = slot;
+  }
+
+  // Takes frames as EncodedFrames from a FrameEncoder, handed over with
+  // UploadEncodedFrame, instead of as bitmaps. Only the encoded bytes are
+  // uploaded, and they're decoded on the GPU. The DrawBitmapFunction gets a
+  // null bitmap. Takes effect from the next run, and only for a single layer.
+  // The textures start out all zeros, like the encoder, and go back to that
+  // on ResizeBitmap, so the encoder has to be replaced too.
+  void SetEncodedInput(bool encoded) {
+    assert(!encoded || (layer_count == 1 && !external_bitmap));
+    encoded_input = encoded;
+  }
+
+  // Only valid from inside the DrawBitmapFunction, at most once a frame.
+  // Every frame the encoder produced has to be uploaded, in order, since each
+  // is a delta against the one before.
+  void UploadEncodedFrame(const EncodedFrame& frame) {
+    assert(encoded_input && encoded_tile_counts[current_frame] == 0);
+    assert(frame.tiles.size() <= CodecTileCount() && frame.words.size() <= (size_t)CodecTileCount() * kMaxTileWords);
+    EncodedTile* table = EncodedTable(current_frame);
+    for (const auto& tile : frame.tiles) {
+      uint32_t tile_x = tile.position & 0xffff;
+      uint32_t tile_y = tile.position >> 16;
+      tiles_listed[tile_y * CodecTilesX() + tile_x] = true;
+      MarkDirty(tile_x * kCodecTileSize, tile_y * kCodecTileSize, kCodecTileSize, kCodecTileSize);
+    }
+    std::copy(frame.tiles.begin(), frame.tiles.end(), table);
+    std::copy(frame.words.begin(), frame.words.end(), EncodedWords(current_frame));
+    encoded_tile_counts[current_frame] = frame.tiles.size();
+    encoded_sizes[current_frame] = frame.Size();
+  }
+
+  // Takes effect from the next frame. Only a few floats change, so the view
+  // can move every frame for free.
+  void SetViewTransform(const ViewTransform& transform) {
+    assert(transform.zoom > 0);
+    view_transform = transform;
+  }
+
+  // Marks part of the first layer as changed. Only valid from inside the
+  // DrawBitmapFunction.
+  void MarkDirty(uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+    MarkLayerDirty(0, x, y, width, height);
+  }
+
+  void MarkLayerDirty(uint32_t layer, uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+    dirty_regions[current_frame][layer].Add({x, y, width, height});
+  }
+
+  // Places a layer in target coordinates, which go from (0, 0) at the top
+  // left to (1, 1) at the bottom right. Layers are drawn in order, later ones
+  // on top, and one with no width or height isn't drawn at all. Takes effect
+  // from the next frame.
+  void SetLayerPlacement(uint32_t layer, float x, float y, float width, float height) {
+    assert(layer < layer_count);
+    layer_placements[layer] = {x, y, width, height, layer};
+  }
+
+  // Loads compiled pipelines from the file when the next run starts and
+  // saves them back when it ends, so later runs skip compiling shaders.
+  void SetPipelineCachePath(const std::string& path) {
+    pipeline_cache_path = path;
+  }
+
+  // Takes effect from the next run.
+  void SetRecordingOptions(const RecordingOptions& options) {
+    assert(options.draw_count > 0);
+    recording_options = options;
+  }
+
+  // Takes effect from the next run.
+  void SetMemoryPath(MemoryPath path) {
+    memory_path = path;
+  }
+
+  // Whether the current or last run's textures are direct, since kDirect
+  // falls back to staging where the device can't support it.
+  bool DirectTextures() const {
+    return direct_textures;
+  }
+
+  // Called at the end of every frame.
+  void SetFrameStatsFunction(const FrameStatsFunction& function) {
+    frame_stats_function = function;
+  }
+
+  // Turns on GPU timestamps for the next run. Timing adds a few commands to
+  // every frame, so it's off unless there's a function to report to.
+  void SetGpuTimingsFunction(const GpuTimingsFunction& function) {
+    gpu_timings_function = function;
+  }
+
+  // The present mode negotiated for the current or last windowed run.
+  VkPresentModeKHR PresentMode() const {
+    return present_mode;
+  }
+
+  // Shows the bitmap in a window until it's closed.
+  void Run(const DrawBitmapFunction& draw_bitmap) {
+    Run(WindowOptions(), draw_bitmap);
+  }
+
+  void Run(const WindowOptions& options, const DrawBitmapFunction& draw_bitmap) {
+    Open(options);
+    SDL_Event event;
+
+    bool run = true;
+    for (uint32_t frame = 0; run && (options.frame_count == 0 || frame < options.frame_count); ++frame) {
+      while(SDL_PollEvent(&event)) {
+        if(event.type == SDL_QUIT) {
+          run = false;
+        }
+      }
+
+      DrawFrame(draw_bitmap);
+    }
+    Close();
+  }
+
+  // Opens a window for a frame loop run with BeginFrame and EndFrame instead
+  // of Run. The caller handles the window's events. Ignores the frame count.
+  void Open(const WindowOptions& options) {
+    headless = false;
+    readback = nullptr;
+    present_mode_policy = options.present_modes;
+    frame_pacing = options.pacing;
+    frame_deadline_ns = options.frame_deadline_ms * 1e6;
+
+    SDL_Init(SDL_INIT_EVERYTHING);
+    window = SDL_CreateWindow(
+        "Affinity", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+        options.width, options.height,
+        SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE | SDL_WINDOW_VULKAN);
+
+    CreateInstance();
+    assert(SDL_Vulkan_CreateSurface(window, instance, &surface));
+    CreateDevice();
+    swapchain = VK_NULL_HANDLE;
+    render_pass = VK_NULL_HANDLE;
+    RecreateSwapchain();
+  }
+
+  void Close() {
+    vkDeviceWaitIdle(device);
+    CollectFinishedFrames();
+
+    DestroySwapchain();
+    DestroyDevice();
+    vkDestroySurfaceKHR(instance, surface, nullptr);
+    DestroyInstance();
+    SDL_DestroyWindow(window);
+  }
+
+  // Draws a fixed number of frames into an offscreen image of the given size,
+  // without a window. Needs no display, so it also runs on software
+  // implementations like lavapipe.
+  void RunHeadless(const HeadlessOptions& options, const DrawBitmapFunction& draw_bitmap) {
+    headless = true;
+    readback = options.readback;
+    frame_pacing = FramePacing::kThroughput;
+    surface = VK_NULL_HANDLE;
+
+    CreateInstance();
+    CreateDevice();
+    CreateOffscreenTargets(options.width, options.height);
+    CreatePipeline();
+    CreateRenderTargets();
+
+    for (uint32_t i = 0; i < options.frame_count; ++i) {
+      DrawFrame(draw_bitmap);
+    }
+    vkDeviceWaitIdle(device);
+    CollectFinishedFrames();
+
+    DestroyRenderTargets();
+    DestroyPipeline();
+    DestroyOffscreenTargets();
+    DestroyDevice();
+    DestroyInstance();
+  }
+};
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+struct DirtyRect {
+  uint32_t x;
+  uint32_t y;
+  uint32_t width;
+  uint32_t height;
+
+  uint32_t Right() const { return x + width; }
+  uint32_t Bottom() const { return y + height; }
+  uint64_t Area() const { return (uint64_t)width * height; }
+
+  bool Intersects(const DirtyRect& other) const {
+    return x < other.Right() && other.x < Right() &&
+           y < other.Bottom() && other.y < Bottom();
+  }
+
+  DirtyRect Union(const DirtyRect& other) const {
+    uint32_t left = std::min(x, other.x);
+    uint32_t top = std::min(y, other.y);
+    return {left, top, std::max(Right(), other.Right()) - left, std::max(Bottom(), other.Bottom()) - top};
+  }
+};
+
+// Accumulates the parts of a bitmap that changed. Rects are merged as they're
+// added so that they never overlap and so that a region turns into a small
+// number of copies.
+class DirtyRegion {
+  // Each rect becomes its own copy, so we'll happily copy this many clean
+  // pixels to save one.
+  static const uint64_t kMergeSlack = 64 * 64;
+  // Past this many rects the whole region collapses to its bounding box.
+  static const size_t kMaxRects = 32;
+
+  uint32_t bitmap_width;
+  uint32_t bitmap_height;
+  std::vector<DirtyRect> rects;
+
+  static bool ShouldMerge(const DirtyRect& a, const DirtyRect& b) {
+    return a.Intersects(b) || a.Union(b).Area() <= a.Area() + b.Area() + kMergeSlack;
+  }
+
+public:
+  DirtyRegion(uint32_t width, uint32_t height): bitmap_width(width), bitmap_height(height) {}
+
+  // Rects are clipped to the bitmap.
+  void Add(DirtyRect rect) {
+    if (rect.x >= bitmap_width || rect.y >= bitmap_height) return;
+    rect.width = std::min(rect.width, bitmap_width - rect.x);
+    rect.height = std::min(rect.height, bitmap_height - rect.y);
+    if (rect.Area() == 0) return;
+
+    // Merging can make the grown rect touch rects we've already passed, so
+    // keep going until nothing merges.
+    bool merged = true;
+    while (merged) {
+      merged = false;
+      for (size_t i = 0; i < rects.size(); ++i) {
+        if (ShouldMerge(rect, rects[i])) {
+          rect = rect.Union(rects[i]);
+          rects.erase(rects.begin() + i);
+          merged = true;
+          break;
+        }
+      }
+    }
+    rects.push_back(rect);
+
+    if (rects.size() > kMaxRects) {
+      DirtyRect bounds = rects[0];
+      for (const auto& r : rects) {
+        bounds = bounds.Union(r);
+      }
+      rects = {bounds};
+    }
+  }
+
+  void Add(const DirtyRegion& other) {
+    for (const auto& rect : other.rects) {
+      Add(rect);
+    }
+  }
+
+  void AddAll() {
+    rects = {{0, 0, bitmap_width, bitmap_height}};
+  }
+
+  void Clear() {
+    rects.clear();
+  }
+
+  bool Empty() const {
+    return rects.empty();
+  }
+
+  // The number of dirty pixels. Exact since rects never overlap.
+  uint64_t Area() const {
+    uint64_t area = 0;
+    for (const auto& rect : rects) {
+      area += rect.Area();
+    }
+    return area;
+  }
+
+  // The fraction of the bitmap that's dirty.
+  double Coverage() const {
+    return (double)Area() / ((uint64_t)bitmap_width * bitmap_height);
+  }
+
+  const std::vector<DirtyRect>& Rects() const {
+    return rects;
+  }
+};
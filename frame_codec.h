@@ -0,0 +1,135 @@
+#pragma once
+
+#include "dirty_region.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Frames encoded as XOR deltas against the frame before them, run length
+// encoded per kCodecTileSize square tile, for sending and recording bitmaps
+// that mostly stay the same. Unchanged pixels XOR to zero, so typical UI and
+// text content turns into a few long zero runs.
+//
+// A tile's words are runs over its pixels in row-major order, clipped to the
+// bitmap's edges. A word with kLiteralRun set is followed by that many
+// deltas, one per pixel. A word without it is followed by one delta for that
+// many pixels. Pixels past a tile's last run are unchanged, as are tiles that
+// aren't listed at all.
+const uint32_t kCodecTileSize = 16;
+const uint32_t kLiteralRun = 0x80000000;
+// Shorter repeats are cheaper as part of a literal run.
+const uint32_t kMinRepeatRun = 3;
+
+struct EncodedTile {
+  // The tile's column in the low 16 bits and its row in the high 16.
+  uint32_t position;
+  // The tile's runs in EncodedFrame::words.
+  uint32_t offset;
+  uint32_t count;
+};
+
+struct EncodedFrame {
+  std::vector<EncodedTile> tiles;
+  std::vector<uint32_t> words;
+
+  // In bytes, as sent or uploaded.
+  size_t Size() const {
+    return tiles.size() * sizeof(EncodedTile) + words.size() * sizeof(uint32_t);
+  }
+};
+
+// A tile's runs never take more than a literal run of all its pixels.
+const uint32_t kMaxTileWords = kCodecTileSize * kCodecTileSize + 1;
+
+// Encodes each frame against the last one it encoded, starting from a frame
+// of all zeros, so every encoded frame has to be decoded, in order.
+class FrameEncoder {
+  uint32_t width;
+  uint32_t height;
+  uint32_t tiles_x;
+  uint32_t tiles_y;
+  std::vector<uint32_t> previous;
+  std::vector<uint32_t> deltas;
+  std::vector<bool> tile_encoded;
+
+  // Appends a tile's runs to words, dropping the unchanged pixels at its end.
+  static void EncodeRuns(const std::vector<uint32_t>& deltas, std::vector<uint32_t>* words) {
+    size_t end = deltas.size();
+    while (end > 0 && deltas[end - 1] == 0) --end;
+    // Where the literal run being built has its count, or -1.
+    int64_t literal = -1;
+    for (size_t i = 0; i < end;) {
+      uint32_t run = 1;
+      while (i + run < end && deltas[i + run] == deltas[i]) ++run;
+      if (run >= kMinRepeatRun) {
+        words->push_back(run);
+        words->push_back(deltas[i]);
+        literal = -1;
+      } else {
+        if (literal == -1) {
+          literal = words->size();
+          words->push_back(kLiteralRun);
+        }
+        (*words)[literal] += run;
+        words->insert(words->end(), deltas.begin() + i, deltas.begin() + i + run);
+      }
+      i += run;
+    }
+  }
+
+public:
+  FrameEncoder(uint32_t width, uint32_t height)
+      : width(width), height(height),
+        tiles_x((width + kCodecTileSize - 1) / kCodecTileSize),
+        tiles_y((height + kCodecTileSize - 1) / kCodecTileSize),
+        previous((size_t)width * height, 0), tile_encoded(tiles_x * tiles_y, false) {
+    assert(tiles_x <= 0x10000 && tiles_y <= 0x10000);
+  }
+
+  // Encodes the tiles of an RGBA bitmap that dirty touches, leaving out any
+  // whose pixels didn't actually change. Replaces frame's contents.
+  void Encode(const uint8_t* bitmap, const DirtyRegion& dirty, EncodedFrame* frame) {
+    frame->tiles.clear();
+    frame->words.clear();
+    for (const auto& rect : dirty.Rects()) {
+      for (uint32_t tile_y = rect.y / kCodecTileSize; tile_y <= (rect.Bottom() - 1) / kCodecTileSize; ++tile_y) {
+        for (uint32_t tile_x = rect.x / kCodecTileSize; tile_x <= (rect.Right() - 1) / kCodecTileSize; ++tile_x) {
+          if (tile_encoded[tile_y * tiles_x + tile_x]) continue;
+          tile_encoded[tile_y * tiles_x + tile_x] = true;
+
+          uint32_t x0 = tile_x * kCodecTileSize;
+          uint32_t y0 = tile_y * kCodecTileSize;
+          uint32_t tile_width = std::min(kCodecTileSize, width - x0);
+          uint32_t tile_height = std::min(kCodecTileSize, height - y0);
+          deltas.clear();
+          for (uint32_t y = y0; y < y0 + tile_height; ++y) {
+            for (uint32_t x = x0; x < x0 + tile_width; ++x) {
+              size_t i = (size_t)y * width + x;
+              uint32_t pixel;
+              memcpy(&pixel, bitmap + i * 4, 4);
+              deltas.push_back(pixel ^ previous[i]);
+              previous[i] = pixel;
+            }
+          }
+
+          uint32_t offset = frame->words.size();
+          EncodeRuns(deltas, &frame->words);
+          uint32_t count = frame->words.size() - offset;
+          if (count > 0) {
+            frame->tiles.push_back({tile_x | tile_y << 16, offset, count});
+          }
+        }
+      }
+    }
+    for (const auto& rect : dirty.Rects()) {
+      for (uint32_t tile_y = rect.y / kCodecTileSize; tile_y <= (rect.Bottom() - 1) / kCodecTileSize; ++tile_y) {
+        for (uint32_t tile_x = rect.x / kCodecTileSize; tile_x <= (rect.Right() - 1) / kCodecTileSize; ++tile_x) {
+          tile_encoded[tile_y * tiles_x + tile_x] = false;
+        }
+      }
+    }
+  }
+};
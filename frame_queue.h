@@ -0,0 +1,289 @@
+#pragma once
+
+#include "dirty_region.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <vector>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Hands RGBA frames from a producer process to the renderer's process through
+// shared memory, without either side ever waiting on the other.
+//
+// The memory holds a ring of slots, each a whole frame. The producer owns one
+// slot that it draws into, the consumer owns the slot it's showing and any it
+// has spare, and one more slot, the latest, holds the newest published frame.
+// Publishing and taking a frame are both a single atomic exchange of the
+// latest slot, so a producer that's faster than the display just replaces
+// frames nobody took, and the consumer always gets the newest one.
+//
+// The layout is the slots, slot_stride apart, followed by a FrameQueueHeader
+// in the last kFrameQueueHeaderSize bytes. Slots and the header are aligned
+// so the slots can be imported as host memory for zero copy uploads.
+
+// Triple buffering, plus one for the frame the renderer's GPU is still
+// reading from while it shows the next one.
+const uint32_t kDefaultFrameQueueSlots = 4;
+const uint32_t kMaxFrameQueueSlots = 8;
+const uint32_t kMaxFrameDirtyRects = 32;
+const uint64_t kFrameQueueAlignment = 64 * 1024;
+const uint64_t kFrameQueueHeaderSize = kFrameQueueAlignment;
+const uint32_t kFrameQueueMagic = 0x41464651;
+// Set in FrameQueueHeader::latest while the consumer hasn't taken the frame.
+const uint32_t kFreshFrame = 0x80000000;
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "Shared memory atomics must be lock free");
+
+struct FrameSlotHeader {
+  // Counts up from 1 in publish order, so gaps are dropped frames.
+  uint64_t sequence;
+  // What changed since a frame the consumer has already taken. More than
+  // kMaxFrameDirtyRects means all of it.
+  uint32_t dirty_count;
+  DirtyRect dirty[kMaxFrameDirtyRects];
+};
+
+struct FrameQueueHeader {
+  uint32_t magic;
+  uint32_t width;
+  uint32_t height;
+  uint32_t slot_count;
+  uint64_t slot_stride;
+  // The latest slot, with kFreshFrame set until it's taken.
+  std::atomic<uint32_t> latest;
+  // Only written by the producer, and only for its own slot.
+  FrameSlotHeader slots[kMaxFrameQueueSlots];
+};
+
+static_assert(sizeof(FrameQueueHeader) <= kFrameQueueHeaderSize, "FrameQueueHeader doesn't fit");
+
+// Slot ownership when a queue is created. The consumer starts out showing
+// slot 0, which is all zeros, with every slot past the producer's spare.
+const uint32_t kInitialShownSlot = 0;
+const uint32_t kInitialLatestSlot = 1;
+const uint32_t kInitialProducerSlot = 2;
+
+// The shared memory and eventfd of a queue, mapped into this process. Either
+// side can create the queue, and the other attaches to its fds, inherited
+// over fork or passed over a unix socket.
+class SharedFrameQueue {
+  int memory_fd;
+  int event_fd;
+  uint8_t* memory;
+  size_t memory_size;
+  FrameQueueHeader* header;
+
+  void Map() {
+    struct stat memory_stat;
+    assert(fstat(memory_fd, &memory_stat) == 0);
+    memory_size = memory_stat.st_size;
+    assert(memory_size > kFrameQueueHeaderSize);
+    memory = static_cast<uint8_t*>(mmap(nullptr, memory_size, PROT_READ | PROT_WRITE, MAP_SHARED, memory_fd, 0));
+    assert(memory != MAP_FAILED);
+    header = reinterpret_cast<FrameQueueHeader*>(memory + memory_size - kFrameQueueHeaderSize);
+  }
+
+public:
+  // Creates a queue of width x height frames in a new memfd.
+  SharedFrameQueue(uint32_t width, uint32_t height, uint32_t slot_count = kDefaultFrameQueueSlots) {
+    assert(slot_count > kInitialProducerSlot && slot_count <= kMaxFrameQueueSlots);
+    uint64_t frame_size = (uint64_t)width * height * 4;
+    uint64_t slot_stride = (frame_size + kFrameQueueAlignment - 1) / kFrameQueueAlignment * kFrameQueueAlignment;
+    memory_fd = memfd_create("affinity_frame_queue", 0);
+    assert(memory_fd != -1);
+    assert(ftruncate(memory_fd, slot_stride * slot_count + kFrameQueueHeaderSize) == 0);
+    event_fd = eventfd(0, EFD_NONBLOCK);
+    assert(event_fd != -1);
+    Map();
+
+    header->magic = kFrameQueueMagic;
+    header->width = width;
+    header->height = height;
+    header->slot_count = slot_count;
+    header->slot_stride = slot_stride;
+    new (&header->latest) std::atomic<uint32_t>(kInitialLatestSlot);
+  }
+
+  // Attaches to a queue created by another process. Takes ownership of the
+  // fds.
+  SharedFrameQueue(int memory_fd, int event_fd): memory_fd(memory_fd), event_fd(event_fd) {
+    Map();
+    assert(header->magic == kFrameQueueMagic);
+  }
+
+  ~SharedFrameQueue() {
+    munmap(memory, memory_size);
+    close(memory_fd);
+    close(event_fd);
+  }
+
+  SharedFrameQueue(const SharedFrameQueue&) = delete;
+  SharedFrameQueue& operator=(const SharedFrameQueue&) = delete;
+
+  int MemoryFd() const { return memory_fd; }
+  // Readable once a frame's been published since the consumer last took one.
+  int EventFd() const { return event_fd; }
+  uint32_t Width() const { return header->width; }
+  uint32_t Height() const { return header->height; }
+  uint32_t SlotCount() const { return header->slot_count; }
+  uint64_t SlotStride() const { return header->slot_stride; }
+
+  FrameQueueHeader& Header() {
+    return *header;
+  }
+
+  uint8_t* Slot(uint32_t slot) {
+    return memory + slot * header->slot_stride;
+  }
+};
+
+// The producer's end. Like the renderer's staging ring, the slot handed out
+// by BeginFrame holds the previous frame, carried forward from the last
+// published slot, so only what changed has to be drawn and marked.
+class FrameProducer {
+  SharedFrameQueue& queue;
+  uint32_t slot;
+  // -1 until the first frame is published.
+  int64_t published_slot;
+  uint64_t sequence;
+  DirtyRegion dirty;
+  // What changed since each slot was last written, indexed by slot.
+  std::vector<DirtyRegion> stale;
+  // What changed since the last frame we know the consumer took.
+  DirtyRegion unseen;
+
+public:
+  explicit FrameProducer(SharedFrameQueue& queue)
+      : queue(queue), slot(kInitialProducerSlot), published_slot(-1), sequence(0),
+        dirty(queue.Width(), queue.Height()),
+        stale(queue.SlotCount(), DirtyRegion(queue.Width(), queue.Height())),
+        unseen(queue.Width(), queue.Height()) {}
+
+  // Past this fraction of the frame being stale we copy all of it.
+  static constexpr double kFullCopyCoverage = 0.5;
+
+  // Returns the bitmap to draw the next frame into, with rows Width() pixels
+  // apart. Never waits.
+  uint8_t* BeginFrame() {
+    uint8_t* bitmap = queue.Slot(slot);
+    if (published_slot != -1) {
+      const uint8_t* source = queue.Slot(published_slot);
+      if (stale[slot].Coverage() > kFullCopyCoverage) {
+        memcpy(bitmap, source, (size_t)queue.Width() * queue.Height() * 4);
+      } else {
+        for (const auto& rect : stale[slot].Rects()) {
+          for (uint32_t y = rect.y; y < rect.Bottom(); ++y) {
+            size_t offset = ((size_t)y * queue.Width() + rect.x) * 4;
+            memcpy(bitmap + offset, source + offset, rect.width * 4);
+          }
+        }
+      }
+    }
+    stale[slot].Clear();
+    dirty.Clear();
+    return bitmap;
+  }
+
+  void MarkDirty(uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+    dirty.Add({x, y, width, height});
+  }
+
+  // Makes the frame the latest, replacing the previous one if the consumer
+  // hasn't taken it yet, and wakes the consumer.
+  void Publish() {
+    for (uint32_t other = 0; other < stale.size(); ++other) {
+      if (other != slot) stale[other].Add(dirty);
+    }
+    unseen.Add(dirty);
+
+    FrameSlotHeader& slot_header = queue.Header().slots[slot];
+    slot_header.sequence = ++sequence;
+    const auto& rects = unseen.Rects();
+    slot_header.dirty_count = rects.size();
+    if (rects.size() <= kMaxFrameDirtyRects) {
+      std::copy(rects.begin(), rects.end(), slot_header.dirty);
+    }
+
+    uint32_t previous = queue.Header().latest.exchange(slot | kFreshFrame, std::memory_order_acq_rel);
+    // The consumer took the previous frame, so it's only missing this one's
+    // changes. Otherwise it was dropped and its changes are still unseen.
+    if (!(previous & kFreshFrame)) {
+      unseen = dirty;
+    }
+    published_slot = slot;
+    slot = previous & ~kFreshFrame;
+
+    // A full counter means the consumer already has a wakeup pending.
+    uint64_t one = 1;
+    ssize_t written = write(queue.EventFd(), &one, sizeof(one));
+    (void)written;
+  }
+};
+
+// The consumer's end. A taken slot stays the consumer's until it's handed
+// back with ReleaseSlot, so it can keep reading it, say from the GPU, after
+// taking newer frames.
+class FrameConsumer {
+  SharedFrameQueue& queue;
+  std::vector<uint32_t> spare_slots;
+  uint64_t last_sequence;
+  uint64_t dropped_frames;
+
+public:
+  explicit FrameConsumer(SharedFrameQueue& queue): queue(queue), last_sequence(0), dropped_frames(0) {
+    for (uint32_t slot = kInitialProducerSlot + 1; slot < queue.SlotCount(); ++slot) {
+      spare_slots.push_back(slot);
+    }
+  }
+
+  // Takes the newest frame if one was published since the last call, and
+  // adds what changed since the last frame taken to dirty. Returns false
+  // without waiting if there's nothing new, or if every slot the consumer
+  // owns is still in use.
+  bool TakeNewestFrame(uint32_t* slot, DirtyRegion* dirty) {
+    uint64_t count;
+    ssize_t drained = read(queue.EventFd(), &count, sizeof(count));
+    (void)drained;
+
+    std::atomic<uint32_t>& latest = queue.Header().latest;
+    if (spare_slots.empty() || !(latest.load(std::memory_order_acquire) & kFreshFrame)) {
+      return false;
+    }
+    // Only we clear the fresh bit, so it's still set, though the slot may
+    // have been replaced by an even newer one.
+    uint32_t taken = latest.exchange(spare_slots.back(), std::memory_order_acq_rel) & ~kFreshFrame;
+    spare_slots.pop_back();
+
+    const FrameSlotHeader& slot_header = queue.Header().slots[taken];
+    dropped_frames += slot_header.sequence - last_sequence - 1;
+    last_sequence = slot_header.sequence;
+    if (slot_header.dirty_count > kMaxFrameDirtyRects) {
+      dirty->AddAll();
+    } else {
+      for (uint32_t i = 0; i < slot_header.dirty_count; ++i) {
+        dirty->Add(slot_header.dirty[i]);
+      }
+    }
+    *slot = taken;
+    return true;
+  }
+
+  // Hands a slot that was taken, or the initially shown one, back once
+  // nothing reads it anymore.
+  void ReleaseSlot(uint32_t slot) {
+    spare_slots.push_back(slot);
+  }
+
+  // Frames the producer published that were replaced before we took them.
+  uint64_t DroppedFrames() const {
+    return dropped_frames;
+  }
+};
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "bitmap_renderer.h"
+#include "frame_queue.h"
+
+#include <cassert>
+#include <cstdint>
+
+// Shows the frames another process publishes to a SharedFrameQueue. The
+// queue's memory is imported into the renderer, so frames are uploaded
+// straight out of the slots the producer drew them into. Each frame picks up
+// the newest published frame, if there is one, and keeps showing the last
+// one otherwise.
+//
+// The source is a DrawBitmapFunction:
+//
+//   BitmapRenderer renderer(width, height);
+//   SharedFrameQueue queue(width, height);
+//   FrameQueueSource source(renderer, queue);
+//   renderer.Run(std::ref(source));
+class FrameQueueSource {
+  BitmapRenderer& renderer;
+  FrameConsumer consumer;
+  DirtyRegion dirty;
+
+public:
+  // Must be created before the renderer's run starts.
+  FrameQueueSource(BitmapRenderer& renderer, SharedFrameQueue& queue)
+      : renderer(renderer), consumer(queue), dirty(queue.Width(), queue.Height()) {
+    assert(queue.Width() == renderer.BitmapWidth() && queue.Height() == renderer.BitmapHeight());
+    assert(renderer.LayerCount() == 1);
+    ExternalBitmapOptions options;
+    options.fd = queue.MemoryFd();
+    options.slot_count = queue.SlotCount();
+    options.slot_stride = queue.SlotStride();
+    options.released = [this](uint32_t slot) { consumer.ReleaseSlot(slot); };
+    renderer.SetExternalBitmap(options);
+  }
+
+  FrameQueueSource(const FrameQueueSource&) = delete;
+  FrameQueueSource& operator=(const FrameQueueSource&) = delete;
+
+  uint64_t DroppedFrames() const {
+    return consumer.DroppedFrames();
+  }
+
+  void operator()(uint8_t*, uint32_t, uint32_t) {
+    uint32_t slot;
+    dirty.Clear();
+    if (!consumer.TakeNewestFrame(&slot, &dirty)) return;
+    renderer.ShowExternalSlot(slot);
+    for (const auto& rect : dirty.Rects()) {
+      renderer.MarkDirty(rect.x, rect.y, rect.width, rect.height);
+    }
+  }
+};
@@ -0,0 +1,277 @@
+#pragma once
+
+#include "bitmap_presenter.h"
+#include "dirty_region.h"
+#include "gl_util.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <GL/glew.h>
+#define NO_SDL_GLEXT
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_opengl.h>
+
+// Covers the viewport with the bitmap. Bitmap rows go top down and GL's
+// texture rows bottom up, so the texture is flipped.
+const char kGlQuadVertSource[] = R"(#version 330 core
+out vec2 tex_coord;
+
+void main() {
+  vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);
+  gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);
+  tex_coord = vec2(corner.x, 1.0 - corner.y);
+}
+)";
+
+const char kGlQuadFragSource[] = R"(#version 330 core
+uniform sampler2D bitmap;
+in vec2 tex_coord;
+out vec4 color;
+
+void main() {
+  color = texture(bitmap, tex_coord);
+}
+)";
+
+inline void GLAPIENTRY GlDebugCallback(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length, const GLchar* message, const void* userParam) {
+  fprintf(stderr, "Debug callback:  %s type = 0x%x, severity = 0x%x, message= %s\n", type == GL_DEBUG_TYPE_ERROR ? "** GL_ERROR **" : "", type, severity, message);
+  assert(type != GL_DEBUG_TYPE_ERROR);
+}
+
+// The fallback for machines without Vulkan. Needs GL 3.3.
+//
+// The bitmap lives in host memory, and each frame its dirty rects are packed
+// into a ring of pixel buffer objects and uploaded with glTexSubImage2D from
+// there, so the copy into a buffer never waits on the GPU reading the one
+// before it. With GL 4.4 or ARB_buffer_storage the buffers stay mapped and
+// each slot has a fence, which we only wait on when the ring wraps around
+// onto a slot the GPU hasn't finished with. Otherwise each upload orphans its
+// buffer, and the driver hands us fresh storage instead of stalling.
+class GlBitmapPresenter : public BitmapPresenter {
+  static const int kPixelBufferCount = 3;
+  struct PixelBuffer {
+    GLuint buffer = 0;
+    void* mapped = nullptr;
+    GLsync fence = nullptr;
+  };
+
+  SDL_Window* window = nullptr;
+  SDL_GLContext context = nullptr;
+  GLuint quad_program;
+  GLuint vertex_array;
+  GLuint texture;
+
+  uint32_t bitmap_width;
+  uint32_t bitmap_height;
+  std::vector<uint8_t> bitmap;
+  DirtyRegion dirty;
+
+  PixelBuffer pixel_buffers[kPixelBufferCount];
+  int next_pixel_buffer = 0;
+  bool persistent_pixel_buffers;
+
+  static GLuint CompileShader(const char* shader_source, GLenum shader_type) {
+    GLuint shader = glCreateShader(shader_type);
+    glShaderSource(shader, 1, &shader_source, NULL);
+    glCompileShader(shader);
+    PrintShaderLog(shader);
+    return shader;
+  }
+
+  static GLuint CompileProgram(const char* vert_source, const char* frag_source) {
+    GLuint program = glCreateProgram();
+    GLuint vert_shader = CompileShader(vert_source, GL_VERTEX_SHADER);
+    GLuint frag_shader = CompileShader(frag_source, GL_FRAGMENT_SHADER);
+    glAttachShader(program, vert_shader);
+    glAttachShader(program, frag_shader);
+    glLinkProgram(program);
+    PrintProgramLog(program);
+    glDeleteShader(vert_shader);
+    glDeleteShader(frag_shader);
+    return program;
+  }
+
+  void DestroyPixelBuffers() {
+    for (int i = 0; i < kPixelBufferCount; ++i) {
+      PixelBuffer& pixel_buffer = pixel_buffers[i];
+      if (pixel_buffer.fence) {
+        glDeleteSync(pixel_buffer.fence);
+      }
+      // Deleting a buffer unmaps it.
+      glDeleteBuffers(1, &pixel_buffer.buffer);
+      pixel_buffer = PixelBuffer();
+    }
+  }
+
+  // (Re)allocates the texture and pixel buffers for the current bitmap size.
+  // Buffer storage is immutable, so the old buffers are replaced rather than
+  // resized.
+  void CreateStreamingTexture() {
+    DestroyPixelBuffers();
+    GLsizeiptr size = (GLsizeiptr)bitmap_width * bitmap_height * 4;
+    for (int i = 0; i < kPixelBufferCount; ++i) {
+      glGenBuffers(1, &pixel_buffers[i].buffer);
+    }
+    if (persistent_pixel_buffers) {
+      const GLbitfield kFlags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+      for (int i = 0; i < kPixelBufferCount; ++i) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixel_buffers[i].buffer);
+        glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, nullptr, kFlags);
+        pixel_buffers[i].mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, kFlags);
+        assert(pixel_buffers[i].mapped);
+      }
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, bitmap_width, bitmap_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    bitmap.assign((size_t)size, 128);
+    dirty = DirtyRegion(bitmap_width, bitmap_height);
+    dirty.AddAll();
+  }
+
+  // Packs the dirty rects into the next pixel buffer and starts uploading
+  // them into the texture, which runs asynchronously on the GPU.
+  void StreamDirtyRects() {
+    if (dirty.Coverage() > kFullUploadCoverage) {
+      dirty.AddAll();
+    }
+    GLsizeiptr size = dirty.Area() * 4;
+    PixelBuffer& pixel_buffer = pixel_buffers[next_pixel_buffer];
+    next_pixel_buffer = (next_pixel_buffer + 1) % kPixelBufferCount;
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixel_buffer.buffer);
+    uint8_t* mapped;
+    if (persistent_pixel_buffers) {
+      if (pixel_buffer.fence) {
+        // The flush makes sure the fence is actually submitted, so this
+        // can't wait forever.
+        glClientWaitSync(pixel_buffer.fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+        glDeleteSync(pixel_buffer.fence);
+        pixel_buffer.fence = nullptr;
+      }
+      mapped = static_cast<uint8_t*>(pixel_buffer.mapped);
+    } else {
+      glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+      mapped = static_cast<uint8_t*>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+      assert(mapped);
+    }
+
+    // Each rect's rows are packed one after another.
+    std::vector<size_t> offsets;
+    size_t offset = 0;
+    for (const auto& rect : dirty.Rects()) {
+      offsets.push_back(offset);
+      for (uint32_t y = rect.y; y < rect.Bottom(); ++y) {
+        memcpy(mapped + offset, bitmap.data() + ((size_t)y * bitmap_width + rect.x) * 4, rect.width * 4);
+        offset += rect.width * 4;
+      }
+    }
+    if (!persistent_pixel_buffers) {
+      glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    }
+
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    for (size_t i = 0; i < dirty.Rects().size(); ++i) {
+      const DirtyRect& rect = dirty.Rects()[i];
+      glTexSubImage2D(GL_TEXTURE_2D, 0, rect.x, rect.y, rect.width, rect.height, GL_RGBA, GL_UNSIGNED_BYTE, reinterpret_cast<const void*>(offsets[i]));
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    if (persistent_pixel_buffers) {
+      pixel_buffer.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+  }
+
+public:
+  // Past this fraction of the bitmap being dirty we upload all of it.
+  static constexpr double kFullUploadCoverage = 0.5;
+
+  GlBitmapPresenter(): dirty(0, 0) {}
+
+  ~GlBitmapPresenter() override {
+    if (!context) return;
+    DestroyPixelBuffers();
+    glDeleteTextures(1, &texture);
+    glDeleteVertexArrays(1, &vertex_array);
+    glDeleteProgram(quad_program);
+    SDL_GL_DeleteContext(context);
+    SDL_DestroyWindow(window);
+  }
+
+  const char* Name() const override {
+    return "gl";
+  }
+
+  void Create(uint32_t window_width, uint32_t window_height, uint32_t bitmap_width_in, uint32_t bitmap_height_in) override {
+    bitmap_width = bitmap_width_in;
+    bitmap_height = bitmap_height_in;
+
+    SDL_Init(SDL_INIT_VIDEO);
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+    window = SDL_CreateWindow("Affinity", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+        window_width, window_height, SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE | SDL_WINDOW_OPENGL);
+    context = SDL_GL_CreateContext(window);
+    assert(glewInit() == GLEW_OK);
+
+#ifdef DEBUG
+    glEnable(GL_DEBUG_OUTPUT);
+    glDebugMessageCallback(GlDebugCallback, nullptr);
+#endif
+
+    quad_program = CompileProgram(kGlQuadVertSource, kGlQuadFragSource);
+    glUseProgram(quad_program);
+    glUniform1i(glGetUniformLocation(quad_program, "bitmap"), 0);
+    // Core profiles need a vertex array bound to draw, even with no
+    // attributes.
+    glGenVertexArrays(1, &vertex_array);
+    glClearColor(0, 0, 0, 1);
+
+    glActiveTexture(GL_TEXTURE0);
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    persistent_pixel_buffers = GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage;
+    CreateStreamingTexture();
+  }
+
+  uint8_t* AcquireBitmap() override {
+    return bitmap.data();
+  }
+
+  void MarkDirty(uint32_t x, uint32_t y, uint32_t width, uint32_t height) override {
+    dirty.Add({x, y, width, height});
+  }
+
+  void Present() override {
+    if (!dirty.Empty()) {
+      StreamDirtyRects();
+      dirty.Clear();
+    }
+
+    int drawable_width, drawable_height;
+    SDL_GL_GetDrawableSize(window, &drawable_width, &drawable_height);
+    glViewport(0, 0, drawable_width, drawable_height);
+    glClear(GL_COLOR_BUFFER_BIT);
+    glUseProgram(quad_program);
+    glBindVertexArray(vertex_array);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    SDL_GL_SwapWindow(window);
+  }
+
+  void Resize(uint32_t bitmap_width_in, uint32_t bitmap_height_in) override {
+    bitmap_width = bitmap_width_in;
+    bitmap_height = bitmap_height_in;
+    CreateStreamingTexture();
+  }
+};
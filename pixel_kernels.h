@@ -0,0 +1,407 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PIXEL_KERNELS_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+// RGBA8 like the bitmap, read as a little endian uint32_t, so red is the low
+// byte and alpha the high one.
+using Pixel = uint32_t;
+
+constexpr Pixel Rgba(uint8_t r, uint8_t g, uint8_t b, uint8_t a = 255) {
+  return (Pixel)r | (Pixel)g << 8 | (Pixel)b << 16 | (Pixel)a << 24;
+}
+
+// Exact rounding of x / 255 for x <= 255 * 255 + 127.
+inline uint32_t DivideBy255(uint32_t x) {
+  x += 128;
+  return (x + (x >> 8)) >> 8;
+}
+
+// Straight alpha src over dst.
+inline Pixel BlendPixel(Pixel dst, Pixel src) {
+  uint32_t alpha = src >> 24;
+  if (alpha == 255) return src;
+  if (alpha == 0) return dst;
+  Pixel out = 0;
+  for (int shift = 0; shift < 32; shift += 8) {
+    uint32_t s = shift == 24 ? 255 : (src >> shift) & 0xff;
+    uint32_t d = (dst >> shift) & 0xff;
+    out |= DivideBy255(s * alpha + d * (255 - alpha)) << shift;
+  }
+  return out;
+}
+
+inline Pixel PremultiplyPixel(Pixel pixel) {
+  uint32_t alpha = pixel >> 24;
+  Pixel out = alpha << 24;
+  for (int shift = 0; shift < 24; shift += 8) {
+    out |= DivideBy255(((pixel >> shift) & 0xff) * alpha) << shift;
+  }
+  return out;
+}
+
+// Done in float so the vector versions can match it exactly. Colors brighter
+// than their alpha, which premultiplied pixels can't have, clamp to 255.
+inline Pixel UnpremultiplyPixel(Pixel pixel) {
+  uint32_t alpha = pixel >> 24;
+  if (alpha == 0) return 0;
+  float scale = 255.0f / alpha;
+  Pixel out = alpha << 24;
+  for (int shift = 0; shift < 24; shift += 8) {
+    float value = std::min((float)((pixel >> shift) & 0xff) * scale + 0.5f, 255.0f);
+    out |= (uint32_t)value << shift;
+  }
+  return out;
+}
+
+// RGBA to BGRA and back.
+inline Pixel SwapRedBluePixel(Pixel pixel) {
+  return (pixel & 0xff00ff00) | (pixel >> 16 & 0xff) | (pixel & 0xff) << 16;
+}
+
+// Loops over spans of pixels. Every implementation gives exactly the same
+// results as the scalar one. Sources and destinations may be unaligned, and
+// for the in place kernels, dst may equal src.
+struct PixelKernels {
+  const char* name;
+  void (*fill)(Pixel* dst, size_t count, Pixel color);
+  // dst = src over dst.
+  void (*blend)(Pixel* dst, const Pixel* src, size_t count);
+  // dst = color over dst.
+  void (*blend_color)(Pixel* dst, size_t count, Pixel color);
+  void (*premultiply)(Pixel* dst, const Pixel* src, size_t count);
+  void (*unpremultiply)(Pixel* dst, const Pixel* src, size_t count);
+  void (*swap_red_blue)(Pixel* dst, const Pixel* src, size_t count);
+};
+
+namespace pixel_kernels {
+
+inline void FillScalar(Pixel* dst, size_t count, Pixel color) {
+  std::fill_n(dst, count, color);
+}
+
+inline void BlendScalar(Pixel* dst, const Pixel* src, size_t count) {
+  for (size_t i = 0; i < count; ++i) dst[i] = BlendPixel(dst[i], src[i]);
+}
+
+inline void BlendColorScalar(Pixel* dst, size_t count, Pixel color) {
+  for (size_t i = 0; i < count; ++i) dst[i] = BlendPixel(dst[i], color);
+}
+
+inline void PremultiplyScalar(Pixel* dst, const Pixel* src, size_t count) {
+  for (size_t i = 0; i < count; ++i) dst[i] = PremultiplyPixel(src[i]);
+}
+
+inline void UnpremultiplyScalar(Pixel* dst, const Pixel* src, size_t count) {
+  for (size_t i = 0; i < count; ++i) dst[i] = UnpremultiplyPixel(src[i]);
+}
+
+inline void SwapRedBlueScalar(Pixel* dst, const Pixel* src, size_t count) {
+  for (size_t i = 0; i < count; ++i) dst[i] = SwapRedBluePixel(src[i]);
+}
+
+#ifdef PIXEL_KERNELS_X86
+
+// The 16 bit lanes of two pixels, with each pixel's alpha in all four of its
+// lanes.
+inline __m128i AlphaLanesLow(__m128i pixels) {
+  __m128i alpha = _mm_srli_epi32(pixels, 24);
+  alpha = _mm_or_si128(alpha, _mm_slli_epi32(alpha, 16));
+  return _mm_unpacklo_epi32(alpha, alpha);
+}
+
+inline __m128i AlphaLanesHigh(__m128i pixels) {
+  __m128i alpha = _mm_srli_epi32(pixels, 24);
+  alpha = _mm_or_si128(alpha, _mm_slli_epi32(alpha, 16));
+  return _mm_unpackhi_epi32(alpha, alpha);
+}
+
+inline __m128i DivideBy255(__m128i x) {
+  x = _mm_add_epi16(x, _mm_set1_epi16(128));
+  return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+// Four pixels of BlendPixel. Products fit in 16 bits, as in the scalar code.
+inline __m128i Blend4(__m128i dst, __m128i src) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i max = _mm_set1_epi16(255);
+  __m128i opaque_src = _mm_or_si128(src, _mm_set1_epi32((int)0xff000000));
+  __m128i alpha_low = AlphaLanesLow(src);
+  __m128i alpha_high = AlphaLanesHigh(src);
+  __m128i low = _mm_add_epi16(
+      _mm_mullo_epi16(_mm_unpacklo_epi8(opaque_src, zero), alpha_low),
+      _mm_mullo_epi16(_mm_unpacklo_epi8(dst, zero), _mm_sub_epi16(max, alpha_low)));
+  __m128i high = _mm_add_epi16(
+      _mm_mullo_epi16(_mm_unpackhi_epi8(opaque_src, zero), alpha_high),
+      _mm_mullo_epi16(_mm_unpackhi_epi8(dst, zero), _mm_sub_epi16(max, alpha_high)));
+  return _mm_packus_epi16(DivideBy255(low), DivideBy255(high));
+}
+
+inline __m128i Premultiply4(__m128i src) {
+  const __m128i zero = _mm_setzero_si128();
+  // Alpha is multiplied by 255, which leaves it as it is.
+  const __m128i alpha_lanes = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+  __m128i low = _mm_mullo_epi16(_mm_unpacklo_epi8(src, zero), _mm_max_epi16(AlphaLanesLow(src), alpha_lanes));
+  __m128i high = _mm_mullo_epi16(_mm_unpackhi_epi8(src, zero), _mm_max_epi16(AlphaLanesHigh(src), alpha_lanes));
+  return _mm_packus_epi16(DivideBy255(low), DivideBy255(high));
+}
+
+inline __m128i SwapRedBlue4(__m128i src) {
+  __m128i red_blue = _mm_set1_epi32(0xff);
+  return _mm_or_si128(_mm_and_si128(src, _mm_set1_epi32((int)0xff00ff00)),
+         _mm_or_si128(_mm_and_si128(_mm_srli_epi32(src, 16), red_blue),
+                      _mm_slli_epi32(_mm_and_si128(src, red_blue), 16)));
+}
+
+// One pixel as four floats, the same operations as UnpremultiplyPixel.
+inline __m128 Unpremultiply1(__m128 pixel) {
+  __m128 alpha = _mm_shuffle_ps(pixel, pixel, _MM_SHUFFLE(3, 3, 3, 3));
+  __m128 scale = _mm_div_ps(_mm_set1_ps(255.0f), _mm_max_ps(alpha, _mm_set1_ps(1.0f)));
+  __m128 value = _mm_min_ps(_mm_add_ps(_mm_mul_ps(pixel, scale), _mm_set1_ps(0.5f)), _mm_set1_ps(255.0f));
+  // Puts alpha back, and zeroes pixels with no alpha.
+  const __m128 color_lanes = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+  value = _mm_or_ps(_mm_and_ps(color_lanes, value), _mm_andnot_ps(color_lanes, alpha));
+  return _mm_and_ps(value, _mm_cmpneq_ps(alpha, _mm_setzero_ps()));
+}
+
+inline void FillSse2(Pixel* dst, size_t count, Pixel color) {
+  __m128i colors = _mm_set1_epi32((int)color);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) _mm_storeu_si128((__m128i*)(dst + i), colors);
+  FillScalar(dst + i, count - i, color);
+}
+
+inline void BlendSse2(Pixel* dst, const Pixel* src, size_t count) {
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+    __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+    _mm_storeu_si128((__m128i*)(dst + i), Blend4(d, s));
+  }
+  BlendScalar(dst + i, src + i, count - i);
+}
+
+inline void BlendColorSse2(Pixel* dst, size_t count, Pixel color) {
+  __m128i colors = _mm_set1_epi32((int)color);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+    _mm_storeu_si128((__m128i*)(dst + i), Blend4(d, colors));
+  }
+  BlendColorScalar(dst + i, count - i, color);
+}
+
+inline void PremultiplySse2(Pixel* dst, const Pixel* src, size_t count) {
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    _mm_storeu_si128((__m128i*)(dst + i), Premultiply4(_mm_loadu_si128((const __m128i*)(src + i))));
+  }
+  PremultiplyScalar(dst + i, src + i, count - i);
+}
+
+inline void UnpremultiplySse2(Pixel* dst, const Pixel* src, size_t count) {
+  const __m128i zero = _mm_setzero_si128();
+  for (size_t i = 0; i < count; ++i) {
+    __m128i pixel = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int)src[i]), zero), zero);
+    __m128i value = _mm_cvttps_epi32(Unpremultiply1(_mm_cvtepi32_ps(pixel)));
+    value = _mm_packus_epi16(_mm_packs_epi32(value, zero), zero);
+    dst[i] = (Pixel)_mm_cvtsi128_si32(value);
+  }
+}
+
+inline void SwapRedBlueSse2(Pixel* dst, const Pixel* src, size_t count) {
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    _mm_storeu_si128((__m128i*)(dst + i), SwapRedBlue4(_mm_loadu_si128((const __m128i*)(src + i))));
+  }
+  SwapRedBlueScalar(dst + i, src + i, count - i);
+}
+
+// AVX2 versions of the above. The 128 bit lanes are independent, so the same
+// unpack and pack steps work per lane.
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 inline __m256i AlphaLanesLow(__m256i pixels) {
+  __m256i alpha = _mm256_srli_epi32(pixels, 24);
+  alpha = _mm256_or_si256(alpha, _mm256_slli_epi32(alpha, 16));
+  return _mm256_unpacklo_epi32(alpha, alpha);
+}
+
+AVX2 inline __m256i AlphaLanesHigh(__m256i pixels) {
+  __m256i alpha = _mm256_srli_epi32(pixels, 24);
+  alpha = _mm256_or_si256(alpha, _mm256_slli_epi32(alpha, 16));
+  return _mm256_unpackhi_epi32(alpha, alpha);
+}
+
+AVX2 inline __m256i DivideBy255(__m256i x) {
+  x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+  return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+AVX2 inline __m256i Blend8(__m256i dst, __m256i src) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i max = _mm256_set1_epi16(255);
+  __m256i opaque_src = _mm256_or_si256(src, _mm256_set1_epi32((int)0xff000000));
+  __m256i alpha_low = AlphaLanesLow(src);
+  __m256i alpha_high = AlphaLanesHigh(src);
+  __m256i low = _mm256_add_epi16(
+      _mm256_mullo_epi16(_mm256_unpacklo_epi8(opaque_src, zero), alpha_low),
+      _mm256_mullo_epi16(_mm256_unpacklo_epi8(dst, zero), _mm256_sub_epi16(max, alpha_low)));
+  __m256i high = _mm256_add_epi16(
+      _mm256_mullo_epi16(_mm256_unpackhi_epi8(opaque_src, zero), alpha_high),
+      _mm256_mullo_epi16(_mm256_unpackhi_epi8(dst, zero), _mm256_sub_epi16(max, alpha_high)));
+  return _mm256_packus_epi16(DivideBy255(low), DivideBy255(high));
+}
+
+AVX2 inline __m256i Premultiply8(__m256i src) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i alpha_lanes = _mm256_set_epi16(255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0);
+  __m256i low = _mm256_mullo_epi16(_mm256_unpacklo_epi8(src, zero), _mm256_max_epi16(AlphaLanesLow(src), alpha_lanes));
+  __m256i high = _mm256_mullo_epi16(_mm256_unpackhi_epi8(src, zero), _mm256_max_epi16(AlphaLanesHigh(src), alpha_lanes));
+  return _mm256_packus_epi16(DivideBy255(low), DivideBy255(high));
+}
+
+AVX2 inline void FillAvx2(Pixel* dst, size_t count, Pixel color) {
+  __m256i colors = _mm256_set1_epi32((int)color);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) _mm256_storeu_si256((__m256i*)(dst + i), colors);
+  FillScalar(dst + i, count - i, color);
+}
+
+AVX2 inline void BlendAvx2(Pixel* dst, const Pixel* src, size_t count) {
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+    __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+    _mm256_storeu_si256((__m256i*)(dst + i), Blend8(d, s));
+  }
+  BlendScalar(dst + i, src + i, count - i);
+}
+
+AVX2 inline void BlendColorAvx2(Pixel* dst, size_t count, Pixel color) {
+  __m256i colors = _mm256_set1_epi32((int)color);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+    _mm256_storeu_si256((__m256i*)(dst + i), Blend8(d, colors));
+  }
+  BlendColorScalar(dst + i, count - i, color);
+}
+
+AVX2 inline void PremultiplyAvx2(Pixel* dst, const Pixel* src, size_t count) {
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    _mm256_storeu_si256((__m256i*)(dst + i), Premultiply8(_mm256_loadu_si256((const __m256i*)(src + i))));
+  }
+  PremultiplyScalar(dst + i, src + i, count - i);
+}
+
+// Two pixels at a time, one per 128 bit lane.
+AVX2 inline void UnpremultiplyAvx2(Pixel* dst, const Pixel* src, size_t count) {
+  const __m256i color_lanes = _mm256_set_epi32(0, -1, -1, -1, 0, -1, -1, -1);
+  size_t i = 0;
+  for (; i + 2 <= count; i += 2) {
+    __m256 pixels = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + i))));
+    __m256 alpha = _mm256_shuffle_ps(pixels, pixels, _MM_SHUFFLE(3, 3, 3, 3));
+    __m256 scale = _mm256_div_ps(_mm256_set1_ps(255.0f), _mm256_max_ps(alpha, _mm256_set1_ps(1.0f)));
+    __m256 value = _mm256_min_ps(_mm256_add_ps(_mm256_mul_ps(pixels, scale), _mm256_set1_ps(0.5f)), _mm256_set1_ps(255.0f));
+    value = _mm256_blendv_ps(alpha, value, _mm256_castsi256_ps(color_lanes));
+    value = _mm256_and_ps(value, _mm256_cmp_ps(alpha, _mm256_setzero_ps(), _CMP_NEQ_OQ));
+    __m256i packed = _mm256_cvttps_epi32(value);
+    packed = _mm256_packus_epi16(_mm256_packs_epi32(packed, packed), packed);
+    dst[i] = (Pixel)_mm256_extract_epi32(packed, 0);
+    dst[i + 1] = (Pixel)_mm256_extract_epi32(packed, 4);
+  }
+  UnpremultiplyScalar(dst + i, src + i, count - i);
+}
+
+AVX2 inline void SwapRedBlueAvx2(Pixel* dst, const Pixel* src, size_t count) {
+  const __m256i shuffle = _mm256_setr_epi8(
+      2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+      2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i pixels = _mm256_loadu_si256((const __m256i*)(src + i));
+    _mm256_storeu_si256((__m256i*)(dst + i), _mm256_shuffle_epi8(pixels, shuffle));
+  }
+  SwapRedBlueScalar(dst + i, src + i, count - i);
+}
+
+#undef AVX2
+
+// AVX2 needs the CPU to have it and the OS to save the YMM registers.
+inline bool CpuHasAvx2() {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+  bool osxsave = ecx & bit_OSXSAVE;
+  bool avx = ecx & bit_AVX;
+  if (!osxsave || !avx) return false;
+  uint32_t xcr0_low, xcr0_high;
+  __asm__("xgetbv" : "=a"(xcr0_low), "=d"(xcr0_high) : "c"(0));
+  if ((xcr0_low & 0x6) != 0x6) return false;
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return false;
+  return ebx & bit_AVX2;
+}
+
+#endif  // PIXEL_KERNELS_X86
+
+}  // namespace pixel_kernels
+
+const PixelKernels kScalarPixelKernels = {
+  "scalar",
+  pixel_kernels::FillScalar,
+  pixel_kernels::BlendScalar,
+  pixel_kernels::BlendColorScalar,
+  pixel_kernels::PremultiplyScalar,
+  pixel_kernels::UnpremultiplyScalar,
+  pixel_kernels::SwapRedBlueScalar,
+};
+
+#ifdef PIXEL_KERNELS_X86
+// SSE2 is part of x86-64, so this is the baseline there.
+const PixelKernels kSse2PixelKernels = {
+  "sse2",
+  pixel_kernels::FillSse2,
+  pixel_kernels::BlendSse2,
+  pixel_kernels::BlendColorSse2,
+  pixel_kernels::PremultiplySse2,
+  pixel_kernels::UnpremultiplySse2,
+  pixel_kernels::SwapRedBlueSse2,
+};
+
+const PixelKernels kAvx2PixelKernels = {
+  "avx2",
+  pixel_kernels::FillAvx2,
+  pixel_kernels::BlendAvx2,
+  pixel_kernels::BlendColorAvx2,
+  pixel_kernels::PremultiplyAvx2,
+  pixel_kernels::UnpremultiplyAvx2,
+  pixel_kernels::SwapRedBlueAvx2,
+};
+#endif
+
+// Every implementation this CPU can run, slowest first.
+inline std::vector<const PixelKernels*> SupportedPixelKernels() {
+  std::vector<const PixelKernels*> kernels = {&kScalarPixelKernels};
+#ifdef PIXEL_KERNELS_X86
+  kernels.push_back(&kSse2PixelKernels);
+  if (pixel_kernels::CpuHasAvx2()) {
+    kernels.push_back(&kAvx2PixelKernels);
+  }
+#endif
+  return kernels;
+}
+
+// The fastest implementation this CPU can run, picked on first use.
+inline const PixelKernels& GetPixelKernels() {
+  static const PixelKernels* kernels = SupportedPixelKernels().back();
+  return *kernels;
+}
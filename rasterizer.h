@@ -0,0 +1,225 @@
+#pragma once
+
+#include "dirty_region.h"
+#include "pixel_kernels.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// Records drawing commands and then draws them into a bitmap all at once.
+// The bitmap is split into tiles that each fit in L1 along with the source
+// rows being read, and the tiles are drawn in parallel. Every tile runs the
+// commands that touch it in the order they were recorded, so the result is
+// the same as drawing them one after another.
+//
+// Meant to be used from a DrawBitmapFunction, so that it draws straight into
+// the renderer's staging memory:
+//
+//   rasterizer.FillRect(0, 0, width, height, Rgba(0, 0, 0));
+//   rasterizer.Line(0, 0, 100, 50, Rgba(255, 0, 0));
+//   for (const auto& rect : rasterizer.Render(bitmap, width, height)) {
+//     renderer.MarkDirty(rect.x, rect.y, rect.width, rect.height);
+//   }
+class Rasterizer {
+public:
+  // 64x64 RGBA pixels is 16 KiB.
+  static const uint32_t kTileSize = 64;
+
+private:
+  enum class CommandType { kFillRect, kBlendRect, kBlit, kLine };
+
+  struct Command {
+    CommandType type;
+    // Unclipped. Lines go from (x, y) to (x1, y1), with width and height
+    // being the size of their bounding box.
+    int32_t x, y;
+    int64_t width, height;
+    int32_t x1, y1;
+    Pixel color;
+    const Pixel* source;
+    uint32_t source_width;
+    bool blend;
+
+    // Filled in by Render.
+    DirtyRect bounds;
+  };
+
+  ThreadPool& pool;
+  std::vector<Command> commands;
+  // The commands touching each tile, kept between frames to save on
+  // allocations.
+  std::vector<std::vector<uint32_t>> tile_commands;
+
+  // Clips a rect to the bitmap. Returns false if nothing's left.
+  static bool Clip(int64_t x, int64_t y, int64_t width, int64_t height, uint32_t bitmap_width, uint32_t bitmap_height, DirtyRect* clipped) {
+    int64_t left = std::max<int64_t>(x, 0);
+    int64_t top = std::max<int64_t>(y, 0);
+    int64_t right = std::min<int64_t>(x + width, bitmap_width);
+    int64_t bottom = std::min<int64_t>(y + height, bitmap_height);
+    if (left >= right || top >= bottom) return false;
+    *clipped = {(uint32_t)left, (uint32_t)top, (uint32_t)(right - left), (uint32_t)(bottom - top)};
+    return true;
+  }
+
+  static DirtyRect Intersect(const DirtyRect& a, const DirtyRect& b) {
+    uint32_t left = std::max(a.x, b.x);
+    uint32_t top = std::max(a.y, b.y);
+    return {left, top, std::min(a.Right(), b.Right()) - left, std::min(a.Bottom(), b.Bottom()) - top};
+  }
+
+  // Rounds to the nearest integer, for b > 0.
+  static int64_t DivideRounded(int64_t a, int64_t b) {
+    int64_t n = 2 * a + b;
+    int64_t d = 2 * b;
+    return n >= 0 ? n / d : -((-n + d - 1) / d);
+  }
+
+  // Lines step one pixel at a time along their longer axis. The position on
+  // the other axis only depends on the step, so tiles agree along their
+  // seams without having to share any state.
+  static void DrawLine(Pixel* pixels, uint32_t stride, const Command& line, const DirtyRect& tile) {
+    int64_t x0 = line.x, y0 = line.y, x1 = line.x1, y1 = line.y1;
+    bool x_major = std::abs(x1 - x0) >= std::abs(y1 - y0);
+    if (!x_major) {
+      std::swap(x0, y0);
+      std::swap(x1, y1);
+    }
+    if (x1 < x0) {
+      std::swap(x0, x1);
+      std::swap(y0, y1);
+    }
+    int64_t major_begin = x_major ? tile.x : tile.y;
+    int64_t major_end = x_major ? tile.Right() : tile.Bottom();
+    int64_t minor_begin = x_major ? tile.y : tile.x;
+    int64_t minor_end = x_major ? tile.Bottom() : tile.Right();
+    for (int64_t major = std::max(x0, major_begin); major <= std::min(x1, major_end - 1); ++major) {
+      int64_t minor = x1 == x0 ? y0 : y0 + DivideRounded((major - x0) * (y1 - y0), x1 - x0);
+      if (minor < minor_begin || minor >= minor_end) continue;
+      Pixel& pixel = x_major ? pixels[minor * stride + major] : pixels[major * stride + minor];
+      pixel = BlendPixel(pixel, line.color);
+    }
+  }
+
+  void DrawTile(Pixel* pixels, uint32_t stride, const DirtyRect& tile, const std::vector<uint32_t>& tile_command_indices) {
+    const PixelKernels& kernels = GetPixelKernels();
+    for (uint32_t index : tile_command_indices) {
+      const Command& command = commands[index];
+      DirtyRect rect = Intersect(command.bounds, tile);
+      switch (command.type) {
+        case CommandType::kFillRect:
+          for (uint32_t y = rect.y; y < rect.Bottom(); ++y) {
+            kernels.fill(pixels + (size_t)y * stride + rect.x, rect.width, command.color);
+          }
+          break;
+        case CommandType::kBlendRect:
+          for (uint32_t y = rect.y; y < rect.Bottom(); ++y) {
+            kernels.blend_color(pixels + (size_t)y * stride + rect.x, rect.width, command.color);
+          }
+          break;
+        case CommandType::kBlit:
+          for (uint32_t y = rect.y; y < rect.Bottom(); ++y) {
+            Pixel* row = pixels + (size_t)y * stride + rect.x;
+            const Pixel* source_row = command.source + (y - command.y) * (size_t)command.source_width + (rect.x - command.x);
+            if (command.blend) {
+              kernels.blend(row, source_row, rect.width);
+            } else {
+              memcpy(row, source_row, rect.width * sizeof(Pixel));
+            }
+          }
+          break;
+        case CommandType::kLine:
+          DrawLine(pixels, stride, command, rect);
+          break;
+      }
+    }
+  }
+
+  void Record(CommandType type, int32_t x, int32_t y, int64_t width, int64_t height, Pixel color) {
+    Command command = {};
+    command.type = type;
+    command.x = x;
+    command.y = y;
+    command.width = width;
+    command.height = height;
+    command.color = color;
+    commands.push_back(command);
+  }
+
+public:
+  explicit Rasterizer(ThreadPool& pool): pool(pool) {}
+
+  // Sets every pixel in the rect to color, alpha included.
+  void FillRect(int32_t x, int32_t y, uint32_t width, uint32_t height, Pixel color) {
+    Record(CommandType::kFillRect, x, y, width, height, color);
+  }
+
+  // Blends color over every pixel in the rect.
+  void BlendRect(int32_t x, int32_t y, uint32_t width, uint32_t height, Pixel color) {
+    Record(CommandType::kBlendRect, x, y, width, height, color);
+  }
+
+  // Copies, or with blend, blends, a source image with its top left corner
+  // at (x, y). The source has to stay alive until Render.
+  void Blit(const Pixel* source, uint32_t source_width, uint32_t source_height, int32_t x, int32_t y, bool blend = false) {
+    Record(CommandType::kBlit, x, y, source_width, source_height, 0);
+    commands.back().source = source;
+    commands.back().source_width = source_width;
+    commands.back().blend = blend;
+  }
+
+  // A one pixel wide line including both endpoints, blended if color isn't
+  // opaque.
+  void Line(int32_t x0, int32_t y0, int32_t x1, int32_t y1, Pixel color) {
+    Record(CommandType::kLine, x0, y0, std::abs((int64_t)x1 - x0) + 1, std::abs((int64_t)y1 - y0) + 1, color);
+    commands.back().x1 = x1;
+    commands.back().y1 = y1;
+  }
+
+  // Draws and clears everything recorded so far into an RGBA bitmap with rows
+  // width pixels apart. Returns each command's rect, clipped to the bitmap,
+  // which is what needs to be marked dirty.
+  std::vector<DirtyRect> Render(uint8_t* bitmap, uint32_t width, uint32_t height) {
+    uint32_t tiles_x = (width + kTileSize - 1) / kTileSize;
+    uint32_t tiles_y = (height + kTileSize - 1) / kTileSize;
+    tile_commands.resize((size_t)tiles_x * tiles_y);
+    for (auto& indices : tile_commands) {
+      indices.clear();
+    }
+
+    std::vector<DirtyRect> drawn;
+    for (uint32_t i = 0; i < commands.size(); ++i) {
+      Command& command = commands[i];
+      int64_t x = command.x, y = command.y;
+      if (command.type == CommandType::kLine) {
+        x = std::min(command.x, command.x1);
+        y = std::min(command.y, command.y1);
+      }
+      if (!Clip(x, y, command.width, command.height, width, height, &command.bounds)) continue;
+      drawn.push_back(command.bounds);
+      for (uint32_t ty = command.bounds.y / kTileSize; ty <= (command.bounds.Bottom() - 1) / kTileSize; ++ty) {
+        for (uint32_t tx = command.bounds.x / kTileSize; tx <= (command.bounds.Right() - 1) / kTileSize; ++tx) {
+          tile_commands[ty * tiles_x + tx].push_back(i);
+        }
+      }
+    }
+
+    Pixel* pixels = reinterpret_cast<Pixel*>(bitmap);
+    pool.ParallelFor(tile_commands.size(), [&](size_t tile) {
+      if (tile_commands[tile].empty()) return;
+      // A copy, since std::min would bind kTileSize by reference and it has
+      // no definition outside the class.
+      uint32_t tile_size = kTileSize;
+      uint32_t tile_x = tile % tiles_x * tile_size;
+      uint32_t tile_y = tile / tiles_x * tile_size;
+      DirtyRect tile_rect = {tile_x, tile_y, std::min(tile_size, width - tile_x), std::min(tile_size, height - tile_y)};
+      DrawTile(pixels, width, tile_rect, tile_commands[tile]);
+    });
+
+    commands.clear();
+    return drawn;
+  }
+};
@@ -17,10 +17,26 @@ void main() {
 
 }*/
 
-layout(location = 0) in vec3 fragColor;
+layout(binding = 0) uniform sampler2DArray bitmap;
+
+layout(push_constant) uniform View {
+    vec2 scale;
+    vec2 offset;
+    uint nearest;
+} view;
+
+layout(location = 0) in vec2 tex_coord;
+layout(location = 1) flat in uint layer;
 
 layout(location = 0) out vec4 outColor;
 
 void main() {
-    outColor = vec4(fragColor, 1.0);
+    vec2 coord = tex_coord;
+    // The sampler filters linearly, so sampling the middle of the nearest
+    // texel gives just that texel.
+    if (view.nearest != 0) {
+        vec2 size = vec2(textureSize(bitmap, 0).xy);
+        coord = (floor(coord * size) + 0.5) / size;
+    }
+    outColor = texture(bitmap, vec3(coord, layer));
 }
@@ -17,16 +17,41 @@ out gl_PerVertex {
     vec4 gl_Position;
 };
 
-layout(location = 0) out vec3 fragColor;
+// Where each layer goes, as a rect in target coordinates from (0, 0) at the
+// top left to (1, 1) at the bottom right. Matches BitmapRenderer's
+// LayerInstance.
+struct LayerInstance {
+    vec4 rect;
+    uint layer;
+};
+
+layout(std430, binding = 1) readonly buffer Instances {
+    LayerInstance instances[];
+};
+
+// Pans and zooms everything in target coordinates. Matches BitmapRenderer's
+// ViewPushConstants.
+layout(push_constant) uniform View {
+    vec2 scale;
+    vec2 offset;
+    uint nearest;
+} view;
+
+layout(location = 0) out vec2 tex_coord;
+layout(location = 1) flat out uint layer;
 
-vec2 positions[4] = vec2[](
-    vec2(-1, -1),
-    vec2(1, -1),
-    vec2(-1, 1),
+vec2 corners[4] = vec2[](
+    vec2(0, 0),
+    vec2(1, 0),
+    vec2(0, 1),
     vec2(1, 1)
 );
 
 void main() {
-    gl_Position = vec4(positions[gl_VertexIndex], 0.0, 1.0);
-    fragColor = vec3(positions[gl_VertexIndex], 1.0);
+    LayerInstance instance = instances[gl_InstanceIndex];
+    vec2 corner = corners[gl_VertexIndex];
+    vec2 position = (instance.rect.xy + corner * instance.rect.zw) * view.scale + view.offset;
+    gl_Position = vec4(position * 2.0 - 1.0, 0.0, 1.0);
+    tex_coord = corner;
+    layer = instance.layer;
 }
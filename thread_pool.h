@@ -0,0 +1,136 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs the iterations of a parallel for loop on a fixed set of threads. Each
+// thread, including the one calling ParallelFor, gets its own queue holding a
+// contiguous run of the iterations, so neighbouring iterations, e.g. tiles in
+// the same rows, tend to run on the same thread. A thread that runs out of
+// work steals from the back of another thread's queue.
+class ThreadPool {
+  struct Queue {
+    std::mutex mutex;
+    std::deque<size_t> indices;
+  };
+
+  // The last queue belongs to the thread calling ParallelFor.
+  std::vector<std::unique_ptr<Queue>> queues;
+  std::vector<std::thread> threads;
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+  uint64_t generation = 0;
+  bool stop = false;
+
+  std::atomic<const std::function<void(size_t)>*> job{nullptr};
+  std::atomic<size_t> remaining{0};
+
+  bool PopTask(size_t self, size_t* index) {
+    Queue& queue = *queues[self];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.indices.empty()) return false;
+    *index = queue.indices.front();
+    queue.indices.pop_front();
+    return true;
+  }
+
+  bool StealTask(size_t self, size_t* index) {
+    for (size_t i = 1; i < queues.size(); ++i) {
+      Queue& queue = *queues[(self + i) % queues.size()];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (!queue.indices.empty()) {
+        *index = queue.indices.back();
+        queue.indices.pop_back();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void RunTasks(size_t self) {
+    size_t index;
+    while (PopTask(self, &index) || StealTask(self, &index)) {
+      (*job.load())(index);
+      if (--remaining == 0) {
+        std::lock_guard<std::mutex> lock(mutex);
+        done.notify_all();
+      }
+    }
+  }
+
+  void WorkerLoop(size_t self) {
+    uint64_t seen_generation = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [&] { return stop || generation != seen_generation; });
+        if (stop) return;
+        seen_generation = generation;
+      }
+      RunTasks(self);
+    }
+  }
+
+public:
+  // Defaults to a thread per core, counting the calling thread.
+  explicit ThreadPool(size_t thread_count = std::thread::hardware_concurrency()) {
+    thread_count = std::max<size_t>(thread_count, 1);
+    for (size_t i = 0; i < thread_count; ++i) {
+      queues.emplace_back(new Queue);
+    }
+    for (size_t i = 0; i + 1 < thread_count; ++i) {
+      threads.emplace_back(&ThreadPool::WorkerLoop, this, i);
+    }
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    wake.notify_all();
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  size_t ThreadCount() const {
+    return queues.size();
+  }
+
+  // Calls function(i) for every i in [0, count) and returns once they've all
+  // finished. Not reentrant, so function mustn't call ParallelFor.
+  void ParallelFor(size_t count, const std::function<void(size_t)>& function) {
+    if (count == 0) return;
+    job = &function;
+    remaining = count;
+    for (size_t q = 0; q < queues.size(); ++q) {
+      std::lock_guard<std::mutex> lock(queues[q]->mutex);
+      for (size_t i = count * q / queues.size(); i < count * (q + 1) / queues.size(); ++i) {
+        queues[q]->indices.push_back(i);
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      ++generation;
+    }
+    wake.notify_all();
+
+    RunTasks(queues.size() - 1);
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&] { return remaining == 0; });
+  }
+};
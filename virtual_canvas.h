@@ -0,0 +1,183 @@
+#pragma once
+
+#include "bitmap_renderer.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+// Fills in one tile of the canvas, tile_width x tile_height RGBA pixels with
+// its top left at (x, y) on the canvas. Tiles on the right and bottom edges
+// hang over the canvas, and can leave the part that does as it is.
+using DrawTileFunction = std::function<void(uint8_t* tile, uint32_t tile_width, uint32_t tile_height, uint64_t x, uint64_t y)>;
+
+// Marks a cache slot that holds no tile.
+const uint64_t kNoCanvasTile = ~0ull;
+
+// Shows part of a canvas that can be far larger than GPU memory, or than the
+// largest image the device supports, through a BitmapRenderer. The canvas is
+// split into tiles the size of the renderer's bitmap, and the renderer's
+// layers become a cache of tiles. Each frame, the tiles in the viewport are
+// paged into the cache, evicting the least recently shown ones, and are drawn
+// with a layer instance each. Memory use only depends on the tile size and
+// the number of layers, never on the canvas size.
+//
+// The canvas is a DrawBitmapFunction:
+//
+//   BitmapRenderer renderer(256, 256, 128);
+//   VirtualCanvas canvas(renderer, 1 << 20, 1 << 20, draw_tile);
+//   canvas.SetViewport(0, 0, 1920, 1440);
+//   renderer.Run(std::ref(canvas));
+class VirtualCanvas {
+  BitmapRenderer& renderer;
+  const uint64_t canvas_width;
+  const uint64_t canvas_height;
+  const uint32_t tile_width;
+  const uint32_t tile_height;
+  const uint64_t tiles_x;
+  const uint64_t tiles_y;
+  DrawTileFunction draw_tile;
+
+  // The part of the canvas shown across the whole target, in canvas pixels.
+  // Starts out as the top left tile, since the whole canvas can be millions
+  // of tiles.
+  double viewport_x = 0, viewport_y = 0, viewport_width, viewport_height;
+
+  // The indirection table, from a canvas tile's index to the cache slot, and
+  // so layer, holding it. Only resident tiles have entries.
+  std::unordered_map<uint64_t, uint32_t> resident_tiles;
+  // For each slot, the tile it holds or kNoCanvasTile, the frame it was last
+  // shown on, and what of it has changed since it was drawn.
+  std::vector<uint64_t> slot_tiles;
+  std::vector<uint64_t> slot_last_used;
+  std::vector<DirtyRegion> slot_stale;
+  uint64_t frame = 0;
+
+  // The slot to page a tile into: an empty one, or else the least recently
+  // shown. Returns false when every slot is showing a tile this frame.
+  bool FindSlot(uint32_t* slot) {
+    uint32_t oldest = 0;
+    for (uint32_t i = 0; i < slot_tiles.size(); ++i) {
+      if (slot_tiles[i] == kNoCanvasTile) {
+        *slot = i;
+        return true;
+      }
+      if (slot_last_used[i] < slot_last_used[oldest]) {
+        oldest = i;
+      }
+    }
+    if (slot_last_used[oldest] == frame) return false;
+    resident_tiles.erase(slot_tiles[oldest]);
+    *slot = oldest;
+    return true;
+  }
+
+  void DrawTile(uint8_t* bitmap, uint32_t slot, uint64_t tile) {
+    uint8_t* pixels = bitmap + slot * renderer.LayerSize();
+    if (slot_tiles[slot] != tile) {
+      memset(pixels, 0, renderer.LayerSize());
+    }
+    draw_tile(pixels, tile_width, tile_height, tile % tiles_x * tile_width, tile / tiles_x * tile_height);
+  }
+
+public:
+  VirtualCanvas(BitmapRenderer& renderer, uint64_t canvas_width, uint64_t canvas_height, const DrawTileFunction& draw_tile)
+      : renderer(renderer), canvas_width(canvas_width), canvas_height(canvas_height),
+        tile_width(renderer.BitmapWidth()), tile_height(renderer.BitmapHeight()),
+        tiles_x((canvas_width + tile_width - 1) / tile_width),
+        tiles_y((canvas_height + tile_height - 1) / tile_height),
+        draw_tile(draw_tile), viewport_width(tile_width), viewport_height(tile_height),
+        slot_tiles(renderer.LayerCount(), kNoCanvasTile), slot_last_used(renderer.LayerCount(), 0),
+        slot_stale(renderer.LayerCount(), DirtyRegion(tile_width, tile_height)) {}
+
+  // Shows the given part of the canvas, in canvas pixels, across the whole
+  // target. Takes effect from the next frame.
+  void SetViewport(double x, double y, double width, double height) {
+    assert(width > 0 && height > 0);
+    viewport_x = x;
+    viewport_y = y;
+    viewport_width = width;
+    viewport_height = height;
+  }
+
+  // Marks part of the canvas as changed. Resident tiles it touches are drawn
+  // again the next time they're shown, and only the changed part of them is
+  // uploaded.
+  void Invalidate(uint64_t x, uint64_t y, uint64_t width, uint64_t height) {
+    uint64_t right = std::min(x + width, canvas_width);
+    uint64_t bottom = std::min(y + height, canvas_height);
+    if (x >= right || y >= bottom) return;
+    for (uint32_t slot = 0; slot < slot_tiles.size(); ++slot) {
+      if (slot_tiles[slot] == kNoCanvasTile) continue;
+      uint64_t tile_x = slot_tiles[slot] % tiles_x * tile_width;
+      uint64_t tile_y = slot_tiles[slot] / tiles_x * tile_height;
+      uint64_t left = std::max(x, tile_x), top = std::max(y, tile_y);
+      uint64_t clipped_right = std::min(right, tile_x + tile_width);
+      uint64_t clipped_bottom = std::min(bottom, tile_y + tile_height);
+      if (left >= clipped_right || top >= clipped_bottom) continue;
+      slot_stale[slot].Add({(uint32_t)(left - tile_x), (uint32_t)(top - tile_y),
+                            (uint32_t)(clipped_right - left), (uint32_t)(clipped_bottom - top)});
+    }
+  }
+
+  // How many tiles are in the cache.
+  size_t ResidentTileCount() const {
+    return resident_tiles.size();
+  }
+
+  // Pages in and places the tiles in the viewport. When there are more of
+  // them than cache slots, the ones that don't fit aren't drawn, and the rest
+  // of the viewport isn't visited.
+  void operator()(uint8_t* bitmap, uint32_t width, uint32_t height) {
+    ++frame;
+    for (uint32_t slot = 0; slot < slot_tiles.size(); ++slot) {
+      renderer.SetLayerPlacement(slot, 0, 0, 0, 0);
+    }
+
+    uint64_t first_x = (uint64_t)std::max(0.0, std::floor(viewport_x / tile_width));
+    uint64_t first_y = (uint64_t)std::max(0.0, std::floor(viewport_y / tile_height));
+    uint64_t last_x = (uint64_t)std::max(0.0, std::min((double)tiles_x, std::ceil((viewport_x + viewport_width) / tile_width)));
+    uint64_t last_y = (uint64_t)std::max(0.0, std::min((double)tiles_y, std::ceil((viewport_y + viewport_height) / tile_height)));
+    // Once every slot is showing a tile this frame, no tile left to visit can
+    // be resident.
+    bool cache_full = false;
+    for (uint64_t ty = first_y; ty < last_y && !cache_full; ++ty) {
+      for (uint64_t tx = first_x; tx < last_x && !cache_full; ++tx) {
+        uint64_t tile = ty * tiles_x + tx;
+        uint32_t slot;
+        auto resident = resident_tiles.find(tile);
+        if (resident != resident_tiles.end()) {
+          slot = resident->second;
+          if (!slot_stale[slot].Empty()) {
+            DrawTile(bitmap, slot, tile);
+            for (const auto& rect : slot_stale[slot].Rects()) {
+              renderer.MarkLayerDirty(slot, rect.x, rect.y, rect.width, rect.height);
+            }
+          }
+        } else {
+          if (!FindSlot(&slot)) {
+            cache_full = true;
+            continue;
+          }
+          DrawTile(bitmap, slot, tile);
+          renderer.MarkLayerDirty(slot, 0, 0, tile_width, tile_height);
+          resident_tiles[tile] = slot;
+          slot_tiles[slot] = tile;
+        }
+        slot_stale[slot].Clear();
+        slot_last_used[slot] = frame;
+
+        renderer.SetLayerPlacement(slot,
+            (tx * tile_width - viewport_x) / viewport_width,
+            (ty * tile_height - viewport_y) / viewport_height,
+            tile_width / viewport_width,
+            tile_height / viewport_height);
+      }
+    }
+  }
+};
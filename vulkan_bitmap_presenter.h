@@ -0,0 +1,56 @@
+#pragma once
+
+#include "bitmap_presenter.h"
+#include "bitmap_renderer.h"
+
+#include <memory>
+
+// Presents through BitmapRenderer, which draws straight into its staging ring
+// or, with resizable BAR, into the mapped textures.
+class VulkanBitmapPresenter : public BitmapPresenter {
+  std::unique_ptr<BitmapRenderer> renderer;
+  WindowOptions options;
+
+public:
+  // The options' size is replaced by the one given to Create.
+  explicit VulkanBitmapPresenter(const WindowOptions& options = WindowOptions()): options(options) {}
+
+  ~VulkanBitmapPresenter() override {
+    if (renderer) {
+      renderer->Close();
+    }
+  }
+
+  // For settings the presenter interface doesn't cover, like frame stats.
+  // Only valid after Create.
+  BitmapRenderer& Renderer() {
+    return *renderer;
+  }
+
+  const char* Name() const override {
+    return "vulkan";
+  }
+
+  void Create(uint32_t window_width, uint32_t window_height, uint32_t bitmap_width, uint32_t bitmap_height) override {
+    renderer.reset(new BitmapRenderer(bitmap_width, bitmap_height));
+    options.width = window_width;
+    options.height = window_height;
+    renderer->Open(options);
+  }
+
+  uint8_t* AcquireBitmap() override {
+    return renderer->BeginFrame();
+  }
+
+  void MarkDirty(uint32_t x, uint32_t y, uint32_t width, uint32_t height) override {
+    renderer->MarkDirty(x, y, width, height);
+  }
+
+  void Present() override {
+    renderer->EndFrame();
+  }
+
+  void Resize(uint32_t bitmap_width, uint32_t bitmap_height) override {
+    renderer->ResizeBitmap(bitmap_width, bitmap_height);
+  }
+};
@@ -1,11 +1,15 @@
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <map>
 #include <set>
 #include <tuple>
 #include <type_traits>
 #include <vector>
+#include <unistd.h>
 #include <vulkan/vulkan.h>
 
 template<class T>
@@ -235,6 +239,22 @@ struct ViewportState : public VkViewportState {
   }
 };
 
+// For pipelines that set their viewport and scissor at draw time, so they
+// don't depend on the target's extent.
+struct DynamicViewportState : public VkViewportState {
+  DynamicViewportState() {
+    sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+    pNext = nullptr;
+    flags = 0;
+    viewportCount = 1;
+    pViewports = nullptr;
+    scissorCount = 1;
+    pScissors = nullptr;
+  }
+};
+
+DVST(PipelineDynamicStateCreateInfo, PIPELINE_DYNAMIC_STATE_CREATE_INFO) {};
+
 struct RasterizationState : public VkRasterizationState {
   RasterizationState() {
     sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
@@ -306,12 +326,15 @@ DVST(GraphicsPipelineCreateInfo, GRAPHICS_PIPELINE_CREATE_INFO) {
   }
 };
 
+DVST(ComputePipelineCreateInfo, COMPUTE_PIPELINE_CREATE_INFO) {};
+
+// Points at SPIR-V that's compiled into the binary, see the makefile, so
+// there's nothing to load or copy.
 DVST(ShaderModuleCreateInfo, SHADER_MODULE_CREATE_INFO) {
-  // We don't know if we'll use this source right away.
-  const std::vector<char> source;
-  ShaderModuleCreateInfo(const std::vector<char>& source): source(source) {
-    codeSize = source.size();
-    pCode = reinterpret_cast<const uint32_t*>(source.data());
+  template <size_t N>
+  ShaderModuleCreateInfo(const uint32_t (&code)[N]) {
+    codeSize = sizeof(code);
+    pCode = code;
   }
 };
 
@@ -368,12 +391,48 @@ DVST(CommandBufferAllocateInfo, COMMAND_BUFFER_ALLOCATE_INFO) {
   }
 };
 
+DVST(CommandBufferInheritanceInfo, COMMAND_BUFFER_INHERITANCE_INFO) {};
+
+// Command buffers are recorded for a single submit unless told otherwise.
 DVST(CommandBufferBeginInfo, COMMAND_BUFFER_BEGIN_INFO) {
   CommandBufferBeginInfo() {
-    flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
+    flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  }
+};
+
+DV(BufferImageCopy) {
+  BufferImageCopy(const VkExtent2D& extent) {
+    imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    imageSubresource.layerCount = 1;
+    imageExtent = {extent.width, extent.height, 1};
+  }
+
+  BufferImageCopy(const VkOffset2D& offset, const VkExtent2D& extent): BufferImageCopy(extent) {
+    imageOffset = {offset.x, offset.y, 0};
+  }
+};
+
+DVST(ImageMemoryBarrier, IMAGE_MEMORY_BARRIER) {
+  ImageMemoryBarrier() {
+    srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    subresourceRange = vkh::ImageSubresourceRange(VK_IMAGE_ASPECT_COLOR_BIT);
   }
 };
 
+DVST(BufferMemoryBarrier, BUFFER_MEMORY_BARRIER) {
+  BufferMemoryBarrier() {
+    srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    size = VK_WHOLE_SIZE;
+  }
+};
+
+DVST(MemoryBarrier, MEMORY_BARRIER) {};
+
+DVST(QueryPoolCreateInfo, QUERY_POOL_CREATE_INFO) {};
+DC(QueryPool);
+
 DVST(SemaphoreCreateInfo, SEMAPHORE_CREATE_INFO) {};
 DC(Semaphore);
 VkSemaphore CreateSemaphore(VkDevice device) {
@@ -407,32 +466,284 @@ DVST(PresentInfoKHR, PRESENT_INFO_KHR) {
   }
 };
 
+// Properties of vkh::physical_device that we look at on every allocation.
+// They're fixed for the life of the device, so they're queried once and
+// queried again only if physical_device changes.
+struct PhysicalDeviceCache {
+  VkPhysicalDevice physical_device = VK_NULL_HANDLE;
+  VkPhysicalDeviceProperties properties;
+  VkPhysicalDeviceMemoryProperties memory_properties;
+};
+
+const PhysicalDeviceCache& GetPhysicalDeviceCache() {
+  static PhysicalDeviceCache cache;
+  if (cache.physical_device != physical_device) {
+    cache.physical_device = physical_device;
+    vkGetPhysicalDeviceProperties(physical_device, &cache.properties);
+    vkGetPhysicalDeviceMemoryProperties(physical_device, &cache.memory_properties);
+  }
+  return cache;
+}
+
 DVST(MemoryAllocateInfo, MEMORY_ALLOCATE_INFO) {};
 
-void AllocateMemory(VkMemoryPropertyFlags required_memory_properties, const VkMemoryRequirements& memory_requirements, VkDeviceMemory* device_memory) {
-  VkPhysicalDeviceMemoryProperties memory_properties;
-  vkGetPhysicalDeviceMemoryProperties(physical_device, &memory_properties);
-
-  int32_t found_memory = -1;
-  for (uint32_t bit=0; bit < memory_properties.memoryTypeCount; ++bit) {
-    if (memory_requirements.memoryTypeBits & (1 << bit) &&
-        (memory_properties.memoryTypes[bit].propertyFlags &
-            required_memory_properties) == required_memory_properties) {
-      found_memory = bit;
+// A piece of a larger VkDeviceMemory block handed out by the MemoryAllocator.
+struct Allocation {
+  VkDeviceMemory memory = VK_NULL_HANDLE;
+  VkDeviceSize offset = 0;
+  VkDeviceSize size = 0;
+
+  // Where the allocation came from, for FreeMemory.
+  uint32_t pool = 0;
+  uint32_t block = 0;
+};
+
+// Sub-allocates buffers and images out of a few large VkDeviceMemory blocks
+// instead of making a vkAllocateMemory call per resource, which is slow and
+// quickly runs into maxMemoryAllocationCount.
+//
+// There's a pool of blocks per memory type. When the device has a
+// bufferImageGranularity larger than 1, linear and optimally tiled resources
+// get separate pools, so they can never share a granularity page.
+class MemoryAllocator {
+  static const VkDeviceSize kBlockSize = 64 * 1024 * 1024;
+
+  struct Block {
+    VkDeviceMemory memory;
+    VkDeviceSize size;
+    // Blocks are mapped the first time any of their allocations are mapped
+    // and stay mapped until the block is freed.
+    void* mapped;
+    uint32_t allocation_count;
+    // Free ranges keyed by offset. Adjacent ranges are always merged.
+    std::map<VkDeviceSize, VkDeviceSize> free_ranges;
+  };
+
+  struct Pool {
+    uint32_t memory_type;
+    bool linear;
+    // Freed blocks are left as null entries so block indices stay stable.
+    std::vector<Block*> blocks;
+  };
+
+  std::vector<Pool> pools;
+
+  static VkDeviceSize AlignUp(VkDeviceSize value, VkDeviceSize alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+  }
+
+  uint32_t GetPool(uint32_t memory_type, bool linear) {
+    if (GetPhysicalDeviceCache().properties.limits.bufferImageGranularity <= 1) {
+      linear = false;
+    }
+
+    for (uint32_t i = 0; i < pools.size(); ++i) {
+      if (pools[i].memory_type == memory_type && pools[i].linear == linear) {
+        return i;
+      }
     }
+    pools.push_back({memory_type, linear, {}});
+    return pools.size() - 1;
   }
-  assert(found_memory != -1);
 
-  vkh::MemoryAllocateInfo F(allocate_info,
-      allocationSize = memory_requirements.size,
-      memoryTypeIndex = found_memory
-  );
-  assert(vkAllocateMemory(device, &allocate_info, nullptr, device_memory) == VK_SUCCESS);
+  // First fit. Alignment padding in front of the allocation stays free.
+  static bool AllocateFromBlock(Block* block, const VkMemoryRequirements& requirements, VkDeviceSize* offset) {
+    for (auto range = block->free_ranges.begin(); range != block->free_ranges.end(); ++range) {
+      VkDeviceSize range_start = range->first;
+      VkDeviceSize range_end = range->first + range->second;
+      VkDeviceSize aligned = AlignUp(range_start, requirements.alignment);
+      if (aligned + requirements.size > range_end) continue;
+
+      block->free_ranges.erase(range);
+      if (aligned > range_start) {
+        block->free_ranges[range_start] = aligned - range_start;
+      }
+      if (aligned + requirements.size < range_end) {
+        block->free_ranges[aligned + requirements.size] = range_end - (aligned + requirements.size);
+      }
+      ++block->allocation_count;
+      *offset = aligned;
+      return true;
+    }
+    return false;
+  }
+
+  static void FreeToBlock(Block* block, VkDeviceSize offset, VkDeviceSize size) {
+    auto next = block->free_ranges.lower_bound(offset);
+    if (next != block->free_ranges.end() && offset + size == next->first) {
+      size += next->second;
+      next = block->free_ranges.erase(next);
+    }
+    if (next != block->free_ranges.begin()) {
+      auto previous = std::prev(next);
+      if (previous->first + previous->second == offset) {
+        previous->second += size;
+        --block->allocation_count;
+        return;
+      }
+    }
+    block->free_ranges[offset] = size;
+    --block->allocation_count;
+  }
+
+  Block* CreateBlock(uint32_t memory_type, VkDeviceSize size) {
+    vkh::MemoryAllocateInfo F(allocate_info,
+        allocationSize = size,
+        memoryTypeIndex = memory_type
+    );
+    Block* block = new Block();
+    assert(vkAllocateMemory(device, &allocate_info, nullptr, &block->memory) == VK_SUCCESS);
+    block->size = size;
+    block->mapped = nullptr;
+    block->allocation_count = 0;
+    block->free_ranges[0] = size;
+    return block;
+  }
+
+  void DestroyBlock(Block* block) {
+    if (block->mapped) {
+      vkUnmapMemory(device, block->memory);
+    }
+    vkFreeMemory(device, block->memory, nullptr);
+    delete block;
+  }
+
+public:
+  Allocation Allocate(uint32_t memory_type, bool linear, const VkMemoryRequirements& requirements) {
+    Allocation allocation;
+    allocation.pool = GetPool(memory_type, linear);
+    allocation.size = requirements.size;
+    Pool& pool = pools[allocation.pool];
+
+    for (uint32_t i = 0; i < pool.blocks.size(); ++i) {
+      if (pool.blocks[i] && AllocateFromBlock(pool.blocks[i], requirements, &allocation.offset)) {
+        allocation.memory = pool.blocks[i]->memory;
+        allocation.block = i;
+        return allocation;
+      }
+    }
+
+    // Nothing fits, so make a new block. Resources bigger than a block get a
+    // block of their own.
+    Block* block = CreateBlock(memory_type, requirements.size > kBlockSize ? requirements.size : kBlockSize);
+    assert(AllocateFromBlock(block, requirements, &allocation.offset));
+
+    auto empty_slot = std::find(pool.blocks.begin(), pool.blocks.end(), nullptr);
+    if (empty_slot == pool.blocks.end()) {
+      empty_slot = pool.blocks.insert(pool.blocks.end(), nullptr);
+    }
+    *empty_slot = block;
+    allocation.memory = block->memory;
+    allocation.block = empty_slot - pool.blocks.begin();
+    return allocation;
+  }
+
+  // Empty blocks are given back to the driver, except for the first block of
+  // each pool so that creating and destroying one resource doesn't thrash.
+  void Free(const Allocation& allocation) {
+    Pool& pool = pools[allocation.pool];
+    Block* block = pool.blocks[allocation.block];
+    FreeToBlock(block, allocation.offset, allocation.size);
+    if (block->allocation_count == 0 && allocation.block != 0) {
+      DestroyBlock(block);
+      pool.blocks[allocation.block] = nullptr;
+    }
+  }
+
+  void* Map(const Allocation& allocation) {
+    Block* block = pools[allocation.pool].blocks[allocation.block];
+    if (!block->mapped) {
+      assert(vkMapMemory(device, block->memory, 0, VK_WHOLE_SIZE, 0, &block->mapped) == VK_SUCCESS);
+    }
+    return static_cast<uint8_t*>(block->mapped) + allocation.offset;
+  }
+
+  // Frees every block. All allocations must have been freed or be unused.
+  void Destroy() {
+    for (auto& pool : pools) {
+      for (Block* block : pool.blocks) {
+        if (block) DestroyBlock(block);
+      }
+    }
+    pools.clear();
+  }
+};
+
+MemoryAllocator memory_allocator;
+
+// A memory type must have all of the required flags. Among those that do, the
+// one with the most preferred flags wins.
+struct MemoryPreference {
+  VkMemoryPropertyFlags required;
+  VkMemoryPropertyFlags preferred;
+};
+
+// Preferences in fallback order. The first one any allowed type satisfies is
+// used.
+struct MemoryPolicy {
+  std::vector<MemoryPreference> preferences;
+
+  MemoryPolicy(VkMemoryPropertyFlags required): preferences({{required, 0}}) {}
+  MemoryPolicy(std::initializer_list<MemoryPreference> preferences_in): preferences(preferences_in) {}
+};
+
+static uint32_t CountBits(uint32_t bits) {
+  uint32_t count = 0;
+  for (; bits; bits &= bits - 1) {
+    ++count;
+  }
+  return count;
+}
+
+// Returns -1 if no type in memory_type_bits has the required flags. Ties go to
+// the lower index since drivers list faster types first.
+int32_t FindMemoryType(uint32_t memory_type_bits, const MemoryPreference& preference) {
+  const auto& memory_properties = GetPhysicalDeviceCache().memory_properties;
+
+  int32_t best_type = -1;
+  uint32_t best_score = 0;
+  for (uint32_t type = 0; type < memory_properties.memoryTypeCount; ++type) {
+    VkMemoryPropertyFlags flags = memory_properties.memoryTypes[type].propertyFlags;
+    if (!(memory_type_bits & (1u << type)) ||
+        (flags & preference.required) != preference.required) {
+      continue;
+    }
+    uint32_t score = CountBits(flags & preference.preferred);
+    if (best_type == -1 || score > best_score) {
+      best_type = type;
+      best_score = score;
+    }
+  }
+  return best_type;
+}
+
+int32_t FindMemoryType(uint32_t memory_type_bits, const MemoryPolicy& policy) {
+  for (const auto& preference : policy.preferences) {
+    int32_t type = FindMemoryType(memory_type_bits, preference);
+    if (type != -1) return type;
+  }
+  return -1;
+}
+
+// Linear resources are buffers and linearly tiled images.
+Allocation AllocateMemory(const MemoryPolicy& policy, const VkMemoryRequirements& memory_requirements, bool linear) {
+  int32_t memory_type = FindMemoryType(memory_requirements.memoryTypeBits, policy);
+  assert(memory_type != -1);
+  return memory_allocator.Allocate(memory_type, linear, memory_requirements);
+}
+
+void FreeMemory(const Allocation& allocation) {
+  memory_allocator.Free(allocation);
+}
+
+// The returned pointer stays valid until the allocation is freed.
+void* MapMemory(const Allocation& allocation) {
+  return memory_allocator.Map(allocation);
 }
 
 DVST(BufferCreateInfo, BUFFER_CREATE_INFO) {};
 DC(Buffer);
-VkBuffer CreateBuffer(VkDeviceSize buffer_size, VkBufferUsageFlags buffer_usage, VkMemoryPropertyFlags memory_properties, VkDeviceMemory* buffer_memory) {
+VkBuffer CreateBuffer(VkDeviceSize buffer_size, VkBufferUsageFlags buffer_usage, const MemoryPolicy& memory_policy, Allocation* buffer_memory) {
   BufferCreateInfo F(buffer_info,
       size = buffer_size,
       usage = buffer_usage
@@ -441,11 +752,101 @@ VkBuffer CreateBuffer(VkDeviceSize buffer_size, VkBufferUsageFlags buffer_usage,
 
   VkMemoryRequirements memory_requirements;
   vkGetBufferMemoryRequirements(device, buffer, &memory_requirements);
-  vkh::AllocateMemory(memory_properties, memory_requirements, buffer_memory);
-  vkBindBufferMemory(device, buffer, *buffer_memory, 0);
+  *buffer_memory = vkh::AllocateMemory(memory_policy, memory_requirements, true);
+  assert(vkBindBufferMemory(device, buffer, buffer_memory->memory, buffer_memory->offset) == VK_SUCCESS);
   return buffer;
 }
 
+DVST(PhysicalDeviceProperties2, PHYSICAL_DEVICE_PROPERTIES_2) {};
+DVST(PhysicalDeviceExternalMemoryHostPropertiesEXT, PHYSICAL_DEVICE_EXTERNAL_MEMORY_HOST_PROPERTIES_EXT) {};
+DVST(ExternalMemoryBufferCreateInfo, EXTERNAL_MEMORY_BUFFER_CREATE_INFO) {};
+DVST(ImportMemoryHostPointerInfoEXT, IMPORT_MEMORY_HOST_POINTER_INFO_EXT) {};
+DVST(ImportMemoryFdInfoKHR, IMPORT_MEMORY_FD_INFO_KHR) {};
+DVST(MemoryHostPointerPropertiesEXT, MEMORY_HOST_POINTER_PROPERTIES_EXT) {};
+DVST(MemoryFdPropertiesKHR, MEMORY_FD_PROPERTIES_KHR) {};
+
+// Host pointers imported with VK_EXT_external_memory_host must start and end
+// on a multiple of this.
+VkDeviceSize ImportedHostPointerAlignment() {
+  PhysicalDeviceExternalMemoryHostPropertiesEXT host_properties;
+  PhysicalDeviceProperties2 F(properties,
+      pNext = &host_properties
+  );
+  vkGetPhysicalDeviceProperties2(physical_device, &properties);
+  return host_properties.minImportedHostPointerAlignment;
+}
+
+// Creates a buffer over memory that some other process or API owns. The
+// memory gets a VkDeviceMemory of its own instead of a piece of one of the
+// MemoryAllocator's blocks, so it's freed with vkFreeMemory.
+//
+// import_info is the VkImportMemory*Info to chain into the allocation, and
+// memory_type_bits the types the driver says can import the handle.
+VkBuffer CreateImportedBuffer(VkDeviceSize buffer_size, VkBufferUsageFlags buffer_usage, VkExternalMemoryHandleTypeFlagBits handle_type, const void* import_info, uint32_t memory_type_bits, VkDeviceMemory* buffer_memory) {
+  ExternalMemoryBufferCreateInfo F(external_info,
+      handleTypes = (VkExternalMemoryHandleTypeFlags)handle_type
+  );
+  BufferCreateInfo F(buffer_info,
+      pNext = &external_info,
+      size = buffer_size,
+      usage = buffer_usage
+  );
+  auto buffer = CreateBuffer(device, buffer_info);
+
+  VkMemoryRequirements memory_requirements;
+  vkGetBufferMemoryRequirements(device, buffer, &memory_requirements);
+  int32_t memory_type = FindMemoryType(memory_requirements.memoryTypeBits & memory_type_bits, MemoryPreference{0, 0});
+  assert(memory_type != -1);
+
+  MemoryAllocateInfo F(allocate_info,
+      pNext = import_info,
+      allocationSize = buffer_size,
+      memoryTypeIndex = (uint32_t)memory_type
+  );
+  assert(vkAllocateMemory(device, &allocate_info, nullptr, buffer_memory) == VK_SUCCESS);
+  assert(vkBindBufferMemory(device, buffer, *buffer_memory, 0) == VK_SUCCESS);
+  return buffer;
+}
+
+// Imports memory mapped at host_pointer, like an mmapped memfd, with
+// VK_EXT_external_memory_host. Both the pointer and size must be aligned to
+// ImportedHostPointerAlignment, and the mapping has to outlive the buffer.
+VkBuffer ImportHostBuffer(void* host_pointer, VkDeviceSize buffer_size, VkBufferUsageFlags buffer_usage, VkDeviceMemory* buffer_memory) {
+  const auto handle_type = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+  auto get_properties = (PFN_vkGetMemoryHostPointerPropertiesEXT) vkGetDeviceProcAddr(device, "vkGetMemoryHostPointerPropertiesEXT");
+  assert(get_properties != nullptr);
+  MemoryHostPointerPropertiesEXT pointer_properties;
+  assert(get_properties(device, handle_type, host_pointer, &pointer_properties) == VK_SUCCESS);
+
+  ImportMemoryHostPointerInfoEXT F(import_info,
+      handleType = handle_type,
+      pHostPointer = host_pointer
+  );
+  return CreateImportedBuffer(buffer_size, buffer_usage, handle_type, &import_info, pointer_properties.memoryTypeBits, buffer_memory);
+}
+
+// Imports an fd with VK_KHR_external_memory_fd. An opaque fd must have been
+// exported by the same driver and device, a dma-buf can come from anything.
+// The import takes ownership of fd.
+VkBuffer ImportFdBuffer(int fd, VkExternalMemoryHandleTypeFlagBits handle_type, VkDeviceSize buffer_size, VkBufferUsageFlags buffer_usage, VkDeviceMemory* buffer_memory) {
+  // Opaque fds can only be imported into the types they were exported from,
+  // which the buffer's requirements already account for.
+  uint32_t memory_type_bits = ~0u;
+  if (handle_type != VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT) {
+    auto get_properties = (PFN_vkGetMemoryFdPropertiesKHR) vkGetDeviceProcAddr(device, "vkGetMemoryFdPropertiesKHR");
+    assert(get_properties != nullptr);
+    MemoryFdPropertiesKHR fd_properties;
+    assert(get_properties(device, handle_type, fd, &fd_properties) == VK_SUCCESS);
+    memory_type_bits = fd_properties.memoryTypeBits;
+  }
+
+  ImportMemoryFdInfoKHR F(import_info,
+      handleType = handle_type,
+      fd = fd
+  );
+  return CreateImportedBuffer(buffer_size, buffer_usage, handle_type, &import_info, memory_type_bits, buffer_memory);
+}
+
 DVST(ImageCreateInfo, IMAGE_CREATE_INFO) {
   ImageCreateInfo() {
     imageType = VK_IMAGE_TYPE_2D;
@@ -457,10 +858,11 @@ DVST(ImageCreateInfo, IMAGE_CREATE_INFO) {
   }
 };
 DC(Image);
-VkImage CreateImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags memory_properties, VkDeviceMemory* image_memory) {
+VkImage CreateImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, const MemoryPolicy& memory_policy, Allocation* image_memory, uint32_t array_layers = 1) {
   vkh::ImageCreateInfo F(image_info,
       extent.width = width,
       extent.height = height,
+      arrayLayers = array_layers,
       format = format,
       tiling = tiling,
       usage = usage
@@ -469,11 +871,62 @@ VkImage CreateImage(uint32_t width, uint32_t height, VkFormat format, VkImageTil
 
   VkMemoryRequirements memory_requirements;
   vkGetImageMemoryRequirements(device, image, &memory_requirements);
-  vkh::AllocateMemory(memory_properties, memory_requirements, image_memory);
-  vkBindImageMemory(device, image, *image_memory, 0);
+  *image_memory = vkh::AllocateMemory(memory_policy, memory_requirements, tiling == VK_IMAGE_TILING_LINEAR);
+  assert(vkBindImageMemory(device, image, image_memory->memory, image_memory->offset) == VK_SUCCESS);
   return image;
 }
 
+DVST(SamplerCreateInfo, SAMPLER_CREATE_INFO) {
+  // Bitmaps are shown pixel for pixel, so we default to nearest filtering.
+  SamplerCreateInfo() {
+    magFilter = VK_FILTER_NEAREST;
+    minFilter = VK_FILTER_NEAREST;
+    mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    maxAnisotropy = 1;
+    borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_BLACK;
+  }
+};
+DC(Sampler);
+
+DV(DescriptorSetLayoutBinding) {
+  DescriptorSetLayoutBinding(uint32_t binding_in, VkDescriptorType type, VkShaderStageFlags stages) {
+    binding = binding_in;
+    descriptorType = type;
+    descriptorCount = 1;
+    stageFlags = stages;
+  }
+};
+
+DVST(DescriptorSetLayoutCreateInfo, DESCRIPTOR_SET_LAYOUT_CREATE_INFO) {};
+DC(DescriptorSetLayout);
+
+DVST(DescriptorPoolCreateInfo, DESCRIPTOR_POOL_CREATE_INFO) {};
+DC(DescriptorPool);
+
+DVST(DescriptorSetAllocateInfo, DESCRIPTOR_SET_ALLOCATE_INFO) {
+  DescriptorSetAllocateInfo(VkDescriptorPool pool, const VkDescriptorSetLayout* layout) {
+    descriptorPool = pool;
+    descriptorSetCount = 1;
+    pSetLayouts = layout;
+  }
+};
+
+VkDescriptorSet AllocateDescriptorSet(VkDescriptorPool pool, VkDescriptorSetLayout layout) {
+  DescriptorSetAllocateInfo allocate_info(pool, &layout);
+  VkDescriptorSet descriptor_set;
+  assert(vkAllocateDescriptorSets(device, &allocate_info, &descriptor_set) == VK_SUCCESS);
+  return descriptor_set;
+}
+
+DVST(WriteDescriptorSet, WRITE_DESCRIPTOR_SET) {
+  WriteDescriptorSet() {
+    descriptorCount = 1;
+  }
+};
+
 VkResult PresentQueue(VkQueue present_queue, VkSemaphore* wait_semaphore, VkSwapchainKHR* swapchain, uint32_t* image_index) {
   PresentInfoKHR present_info(wait_semaphore, swapchain, image_index);
   return vkQueuePresentKHR(present_queue, &present_info);
@@ -495,10 +948,88 @@ DC(PipelineLayout);
 DC(ImageView);
 DCE(Swapchain, KHR);
 
+DVST(PipelineCacheCreateInfo, PIPELINE_CACHE_CREATE_INFO) {};
+DC(PipelineCache);
+
+// Used for all pipeline creation when set.
+VkPipelineCache pipeline_cache = VK_NULL_HANDLE;
+
+// Pipeline cache files are the driver's cache data behind this header. The
+// data's own header identifies the device but not the driver version, and
+// drivers are free to reject or, worse, misread data from another version.
+struct PipelineCacheFileHeader {
+  uint32_t magic;
+  uint32_t driver_version;
+  uint64_t data_size;
+};
+const uint32_t kPipelineCacheFileMagic = 0x50434641;  // "AFCP"
+
+// Checks the header at the start of cache data against the current device.
+bool PipelineCacheDataMatchesDevice(const std::vector<char>& data) {
+  const auto& properties = GetPhysicalDeviceCache().properties;
+  uint32_t header_size, header_version, vendor_id, device_id;
+  if (data.size() < 16 + VK_UUID_SIZE) return false;
+  memcpy(&header_size, &data[0], 4);
+  memcpy(&header_version, &data[4], 4);
+  memcpy(&vendor_id, &data[8], 4);
+  memcpy(&device_id, &data[12], 4);
+  return header_size >= 16 + VK_UUID_SIZE && header_size <= data.size() &&
+         header_version == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+         vendor_id == properties.vendorID && device_id == properties.deviceID &&
+         memcmp(&data[16], properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+}
+
+// Creates a pipeline cache seeded from a file written by SavePipelineCache.
+// The cache starts out empty if there's no file, if it was written by
+// another device or driver, or if it's truncated or corrupt.
+VkPipelineCache LoadPipelineCache(const std::string& filename) {
+  std::vector<char> data;
+  std::ifstream file(filename, std::ios::binary | std::ios::ate);
+  std::streamoff file_size = file ? (std::streamoff)file.tellg() : 0;
+  file.seekg(0);
+  PipelineCacheFileHeader header;
+  if (file.read(reinterpret_cast<char*>(&header), sizeof(header)) &&
+      header.magic == kPipelineCacheFileMagic &&
+      header.driver_version == GetPhysicalDeviceCache().properties.driverVersion &&
+      header.data_size <= (uint64_t)(file_size - (std::streamoff)sizeof(header))) {
+    data.resize(header.data_size);
+    if (!file.read(data.data(), data.size()) || !PipelineCacheDataMatchesDevice(data)) {
+      data.clear();
+    }
+  }
+
+  vkh::PipelineCacheCreateInfo F(create_info,
+      initialDataSize = data.size(),
+      pInitialData = data.data()
+  );
+  return CreatePipelineCache(create_info);
+}
+
+// Writes to a temporary file that's renamed over the old one, so processes
+// sharing the file never see a partial cache.
+void SavePipelineCache(VkPipelineCache cache, const std::string& filename) {
+  size_t size = 0;
+  assert(vkGetPipelineCacheData(device, cache, &size, nullptr) == VK_SUCCESS);
+  std::vector<char> data(size);
+  assert(vkGetPipelineCacheData(device, cache, &size, data.data()) == VK_SUCCESS);
+  data.resize(size);
+
+  PipelineCacheFileHeader header = {kPipelineCacheFileMagic, GetPhysicalDeviceCache().properties.driverVersion, size};
+  std::string temp_filename = filename + "." + std::to_string(getpid());
+  std::ofstream file(temp_filename, std::ios::binary);
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  file.write(data.data(), data.size());
+  file.close();
+  if (file.fail() || std::rename(temp_filename.c_str(), filename.c_str()) != 0) {
+    std::cerr << "Couldn't write pipeline cache " << filename << std::endl;
+    std::remove(temp_filename.c_str());
+  }
+}
+
 // The following create functions don't follow the above patterns very well.
 VkPipeline CreateGraphicsPipeline(VkDevice device, const VkGraphicsPipelineCreateInfo& create_info) {
   VkPipeline pipeline;
-  assert(vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &create_info, nullptr, &pipeline) == VK_SUCCESS);
+  assert(vkCreateGraphicsPipelines(device, pipeline_cache, 1, &create_info, nullptr, &pipeline) == VK_SUCCESS);
   return pipeline;
 }
 
@@ -553,19 +1084,6 @@ int32_t GetQueueFamilySupportingSurface(VkPhysicalDevice physical_device, VkSurf
     return -1;
 }
 
-std::vector<char> ReadFile(const std::string& filename) {
-  std::ifstream file(filename);
-  assert(file.is_open());
-
-  file.seekg(0, std::ios::end);
-  size_t length = file.tellg();
-  file.seekg(0, std::ios::beg);
-
-  std::vector<char> file_contents(length);
-  file.read(file_contents.data(), length);
-  return file_contents;
-}
-
 // Functions all come from demo.
 static VKAPI_ATTR VkBool32 VKAPI_CALL DebugCallback(
     VkDebugReportFlagsEXT flags,
@@ -600,9 +1118,9 @@ void DestroyDebugReportCallbackEXT(VkInstance instance, VkDebugReportCallbackEXT
 }
 
 namespace h {
-VkShaderModule ShaderModule(VkDevice device, const std::string& filename) {
-  const auto source = ReadFile(filename);
-  const auto create_info = vkh::ShaderModuleCreateInfo(source);
+template <size_t N>
+VkShaderModule ShaderModule(VkDevice device, const uint32_t (&code)[N]) {
+  const vkh::ShaderModuleCreateInfo create_info(code);
   return CreateShaderModule(device, create_info);
 }
 }